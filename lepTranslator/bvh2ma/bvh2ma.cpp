@@ -0,0 +1,294 @@
+//
+//  bvh2ma : converts bvh files to maya ascii scenes, without maya.
+//
+//      g++ -O2 -I.. bvh2ma.cpp ../bvhCore.cpp -o bvh2ma
+//      ./bvh2ma [-q] [-o output_dir] file.bvh...
+//
+//  The scene holds what the Lep translator creates when it imports the
+//  same file : one joint per ROOT / JOINT (offset and rotate order), and one
+//  animCurveTL / animCurveTA per channel, keyed on every frame (film time)
+//  with the rotations unwrapped by BvhRotationFilter.
+//  -q converts the rotation curves to quaternion interpolation, like the
+//  translator option quaternionCurves=1.
+//
+
+#include "bvhCore.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+// values written per line of a ktv array
+static const int keys_per_line = 8;
+
+/*
+* Maya node names only have letters, digits and underscores,
+* anything else would also break the quoting of the .ma file.
+*/
+static std::string maya_name(const std::string &name)
+{
+	std::string ret;
+	for (size_t i = 0; i < name.size(); i++) {
+		char c = name[i];
+		bool valid = ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) ||
+			((c >= '0') && (c <= '9')) || (c == '_');
+		ret += valid ? c : '_';
+	}
+	if (ret.empty() || ((ret[0] >= '0') && (ret[0] <= '9'))) {
+		ret = "_" + ret;
+	}
+	return ret;
+}
+
+// name not used yet in the scene, maya style (name, name1, name2...)
+static std::string unique_name(const std::string &name, std::set<std::string> &used)
+{
+	std::string ret = name;
+	for (int i = 1; used.count(ret) != 0; i++) {
+		char suffix[16];
+		sprintf(suffix, "%d", i);
+		ret = name + suffix;
+	}
+	used.insert(ret);
+	return ret;
+}
+
+static const char *short_attribute(BvhChannel channel)
+{
+	switch (channel) {
+	case kBvhXposition:
+		return "tx";
+	case kBvhYposition:
+		return "ty";
+	case kBvhZposition:
+		return "tz";
+	case kBvhXrotation:
+		return "rx";
+	case kBvhYrotation:
+		return "ry";
+	case kBvhZrotation:
+		return "rz";
+	default:
+		return NULL;
+	}
+}
+
+static const char *long_attribute(BvhChannel channel)
+{
+	switch (channel) {
+	case kBvhXposition:
+		return "translateX";
+	case kBvhYposition:
+		return "translateY";
+	case kBvhZposition:
+		return "translateZ";
+	case kBvhXrotation:
+		return "rotateX";
+	case kBvhYrotation:
+		return "rotateY";
+	case kBvhZrotation:
+		return "rotateZ";
+	default:
+		return NULL;
+	}
+}
+
+static bool write_ma(FILE *out, const std::string &scene_name, const BvhSkeleton &skeleton,
+	const std::vector<double> &frames, bool quaternion_curves)
+{
+	const int channel_count = skeleton.channel_count;
+	const int frame_count = (channel_count > 0) ? (int)(frames.size() / channel_count) : 0;
+
+	fprintf(out, "//Maya ASCII 2016 scene\n");
+	fprintf(out, "//Name: %s\n", scene_name.c_str());
+	fprintf(out, "//Codeset: UTF-8\n");
+	fprintf(out, "requires maya \"2016\";\n");
+	fprintf(out, "currentUnit -l centimeter -a degree -t film;\n");
+
+	// joints, End Sites are skipped like in the translator
+	std::set<std::string> used;
+	std::vector<std::string> paths(skeleton.joints.size());
+	for (size_t j = 0; j < skeleton.joints.size(); j++) {
+		const BvhJoint &joint = skeleton.joints[j];
+		if (joint.end_site) {
+			continue;
+		}
+		std::string name = maya_name(joint.name);
+		if (joint.parent == -1) {
+			// roots must not clash with each other
+			name = unique_name(name, used);
+			paths[j] = "|" + name;
+			fprintf(out, "createNode joint -n \"%s\";\n", name.c_str());
+		}
+		else {
+			used.insert(name);
+			paths[j] = paths[joint.parent] + "|" + name;
+			fprintf(out, "createNode joint -n \"%s\" -p \"%s\";\n", name.c_str(), paths[joint.parent].c_str());
+		}
+		fprintf(out, "\tsetAttr \".t\" -type \"double3\" %.10g %.10g %.10g ;\n",
+			joint.offset[0], joint.offset[1], joint.offset[2]);
+		if (joint.order != kBvhXYZ) {
+			fprintf(out, "\tsetAttr \".ro\" %d;\n", (int)joint.order);
+		}
+	}
+
+	// curves, keys streamed column by column out of the frame matrix
+	std::vector<std::string> rotation_curves;
+	std::vector<std::string> connections;
+	for (size_t j = 0; j < skeleton.joints.size(); j++) {
+		const BvhJoint &joint = skeleton.joints[j];
+		for (size_t i = 0; i < joint.channels.size(); i++) {
+			const BvhChannel channel = joint.channels[i];
+			const int c = joint.first_channel + (int)i;
+			if ((channel == kBvhInvalidChannel) || (frame_count == 0)) {
+				continue;
+			}
+			std::string curve = unique_name(maya_name(joint.name) + "_" + long_attribute(channel), used);
+			fprintf(out, "createNode %s -n \"%s\";\n",
+				bvh_is_rotation(channel) ? "animCurveTA" : "animCurveTL", curve.c_str());
+			fprintf(out, "\tsetAttr \".wgt\" no;\n");
+			fprintf(out, "\tsetAttr -s %d \".ktv[0:%d]\"", frame_count, frame_count - 1);
+			for (int f = 0; f < frame_count; f++) {
+				if ((f % keys_per_line) == 0) {
+					fprintf(out, "\n\t\t");
+				}
+				fprintf(out, " %d %.10g", f, frames[(size_t)f * channel_count + c]);
+			}
+			fprintf(out, ";\n");
+
+			connections.push_back("connectAttr \"" + curve + ".o\" \"" + paths[j] + "." + short_attribute(channel) + "\";");
+			if (bvh_is_rotation(channel)) {
+				rotation_curves.push_back(curve);
+			}
+		}
+	}
+	for (size_t i = 0; i < connections.size(); i++) {
+		fprintf(out, "%s\n", connections[i].c_str());
+	}
+
+	if (quaternion_curves && !rotation_curves.empty()) {
+		fprintf(out, "rotationInterpolation -c quaternionSlerp");
+		for (size_t i = 0; i < rotation_curves.size(); i++) {
+			fprintf(out, " \"%s\"", rotation_curves[i].c_str());
+		}
+		fprintf(out, ";\n");
+	}
+	fprintf(out, "// End of %s\n", scene_name.c_str());
+	return ferror(out) == 0;
+}
+
+// "dir/walk.bvh" -> "walk"
+static std::string base_name(const std::string &path)
+{
+	size_t slash = path.find_last_of("/\\");
+	std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+	size_t dot = name.find_last_of('.');
+	if ((dot != std::string::npos) && (dot > 0)) {
+		name = name.substr(0, dot);
+	}
+	return name;
+}
+
+static bool convert(const std::string &input, const std::string &output_dir, bool quaternion_curves)
+{
+	std::ifstream inputfile(input.c_str(), std::ios::in);
+	if (!inputfile) {
+		fprintf(stderr, "%s: could not be opened for reading\n", input.c_str());
+		return false;
+	}
+
+	BvhReader bvh_reader(inputfile);
+	BvhSkeleton skeleton;
+	std::vector<double> frames;
+	if (!bvh_reader.readHierarchy(skeleton) || !bvh_reader.readFrames(skeleton, frames)) {
+		const BvhError &error = bvh_reader.error();
+		fprintf(stderr, "%s:%d: %s\n", input.c_str(), error.line, error.message.c_str());
+		return false;
+	}
+
+	const int channel_count = skeleton.channel_count;
+	const int frame_count = (channel_count > 0) ? (int)(frames.size() / channel_count) : 0;
+	if (frame_count > 0) {
+		BvhRotationFilter rotation_filter;
+		bvh_add_rotation_tracks(skeleton, rotation_filter);
+		rotation_filter.apply(&frames[0], frame_count, channel_count);
+	}
+
+	std::string scene_name = base_name(input) + ".ma";
+	std::string output;
+	if (!output_dir.empty()) {
+		output = output_dir + "/" + scene_name;
+	}
+	else {
+		size_t slash = input.find_last_of("/\\");
+		output = ((slash == std::string::npos) ? std::string("") : input.substr(0, slash + 1)) + scene_name;
+	}
+
+	FILE *out = fopen(output.c_str(), "w");
+	if (out == NULL) {
+		fprintf(stderr, "%s: could not be opened for writing\n", output.c_str());
+		return false;
+	}
+	static char out_buffer[1 << 16];
+	setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+	bool written = write_ma(out, scene_name, skeleton, frames, quaternion_curves);
+	if ((fclose(out) != 0) || !written) {
+		fprintf(stderr, "%s: write error\n", output.c_str());
+		return false;
+	}
+	return true;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage : bvh2ma [-q] [-o output_dir] file.bvh...\n");
+	fprintf(stderr, "  -q  quaternion interpolation for the rotation curves\n");
+	fprintf(stderr, "  -o  directory of the .ma files (default : next to each bvh)\n");
+}
+
+int main(int argc, char **argv)
+{
+	bool quaternion_curves = false;
+	std::string output_dir;
+	std::vector<std::string> inputs;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-q") == 0) {
+			quaternion_curves = true;
+		}
+		else if (strcmp(argv[i], "-o") == 0) {
+			if (i + 1 >= argc) {
+				usage();
+				return 2;
+			}
+			output_dir = argv[++i];
+		}
+		else if (argv[i][0] == '-') {
+			usage();
+			return 2;
+		}
+		else {
+			inputs.push_back(argv[i]);
+		}
+	}
+	if (inputs.empty()) {
+		usage();
+		return 2;
+	}
+
+	// a bad file does not stop the batch
+	int failed = 0;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		if (!convert(inputs[i], output_dir, quaternion_curves)) {
+			failed++;
+		}
+	}
+	if (failed > 0) {
+		fprintf(stderr, "%d of %d files failed\n", failed, (int)inputs.size());
+		return 1;
+	}
+	return 0;
+}
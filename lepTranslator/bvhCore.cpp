@@ -0,0 +1,827 @@
+//
+//  bvhCore : the maya independent part of the bvh translator.
+//
+
+#include "bvhCore.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <limits>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+// axes (0 = x, 1 = y, 2 = z) of each rotate order, first applied first
+static const int order_axes[6][3] = {
+	{ 0, 1, 2 }, // xyz
+	{ 1, 2, 0 }, // yzx
+	{ 2, 0, 1 }, // zxy
+	{ 0, 2, 1 }, // xzy
+	{ 1, 0, 2 }, // yxz
+	{ 2, 1, 0 }, // zyx
+};
+
+BvhChannel bvh_channel_from_name(const char *name)
+{
+	if (strcmp(name, "Xposition") == 0) {
+		return kBvhXposition;
+	}
+	else if (strcmp(name, "Yposition") == 0) {
+		return kBvhYposition;
+	}
+	else if (strcmp(name, "Zposition") == 0) {
+		return kBvhZposition;
+	}
+	else if (strcmp(name, "Xrotation") == 0) {
+		return kBvhXrotation;
+	}
+	else if (strcmp(name, "Yrotation") == 0) {
+		return kBvhYrotation;
+	}
+	else if (strcmp(name, "Zrotation") == 0) {
+		return kBvhZrotation;
+	}
+	return kBvhInvalidChannel;
+}
+
+bool bvh_is_rotation(BvhChannel channel)
+{
+	return (channel == kBvhXrotation) || (channel == kBvhYrotation) || (channel == kBvhZrotation);
+}
+
+bool bvh_rotate_order_from_channels(const std::vector<BvhChannel> &channels, BvhRotateOrder &order)
+{
+	// rotations in the order they are written, the last one is applied first
+	int written[3];
+	int count = 0;
+	for (size_t i = 0; i < channels.size(); i++) {
+		if (bvh_is_rotation(channels[i])) {
+			if (count == 3) {
+				count = 4; // more than 3 rotations
+				break;
+			}
+			written[count] = channels[i] - kBvhXrotation;
+			count++;
+		}
+	}
+	order = kBvhXYZ;
+	if (count != 3) {
+		return false;
+	}
+	for (int o = 0; o < 6; o++) {
+		if ((order_axes[o][0] == written[2]) &&
+			(order_axes[o][1] == written[1]) &&
+			(order_axes[o][2] == written[0])) {
+			order = (BvhRotateOrder)o;
+			return true;
+		}
+	}
+	return false; // same axis written twice
+}
+
+BvhQuat bvh_quat_mul(const BvhQuat &a, const BvhQuat &b)
+{
+	BvhQuat r;
+	r.w = a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z;
+	r.x = a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y;
+	r.y = a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x;
+	r.z = a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w;
+	return r;
+}
+
+BvhQuat bvh_quat_conjugate(const BvhQuat &q)
+{
+	BvhQuat r = { q.w, -q.x, -q.y, -q.z };
+	return r;
+}
+
+static BvhQuat axis_quat(int axis, double angle)
+{
+	BvhQuat q = { cos(angle * 0.5), 0.0, 0.0, 0.0 };
+	double s = sin(angle * 0.5);
+	if (axis == 0) {
+		q.x = s;
+	}
+	else if (axis == 1) {
+		q.y = s;
+	}
+	else {
+		q.z = s;
+	}
+	return q;
+}
+
+// rotation matrix (column vectors) of a unit quaternion
+static void quat_to_matrix(const BvhQuat &q, double m[3][3])
+{
+	double xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+	double xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+	double wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+	m[0][0] = 1.0 - 2.0 * (yy + zz);
+	m[0][1] = 2.0 * (xy - wz);
+	m[0][2] = 2.0 * (xz + wy);
+	m[1][0] = 2.0 * (xy + wz);
+	m[1][1] = 1.0 - 2.0 * (xx + zz);
+	m[1][2] = 2.0 * (yz - wx);
+	m[2][0] = 2.0 * (xz - wy);
+	m[2][1] = 2.0 * (yz + wx);
+	m[2][2] = 1.0 - 2.0 * (xx + yy);
+}
+
+BvhQuat bvh_euler_to_quat(const double euler[3], BvhRotateOrder order)
+{
+	const int *axes = order_axes[order];
+	BvhQuat q = axis_quat(axes[0], euler[axes[0]]);
+	q = bvh_quat_mul(axis_quat(axes[1], euler[axes[1]]), q);
+	q = bvh_quat_mul(axis_quat(axes[2], euler[axes[2]]), q);
+	return q;
+}
+
+// angle + 2*k*pi, as close as possible to target
+static double nearest_turn(double angle, double target)
+{
+	return angle + 2.0 * BVH_PI * floor((target - angle) / (2.0 * BVH_PI) + 0.5);
+}
+
+void bvh_quat_to_euler(const BvhQuat &q, BvhRotateOrder order, const double hint[3], double euler[3])
+{
+	const int i = order_axes[order][0];
+	const int j = order_axes[order][1];
+	const int k = order_axes[order][2];
+	// xyz, yzx and zxy are cyclic, the other orders flip some signs
+	const double s = (order <= kBvhZXY) ? 1.0 : -1.0;
+
+	double m[3][3];
+	quat_to_matrix(q, m);
+
+	double a, b, c;
+	double sb = -s * m[k][i];
+	if (sb > 1.0) {
+		sb = 1.0;
+	}
+	else if (sb < -1.0) {
+		sb = -1.0;
+	}
+	b = asin(sb);
+	if (fabs(sb) < 1.0 - 1e-9) {
+		a = atan2(s * m[k][j], m[k][k]);
+		c = atan2(s * m[j][i], m[i][i]);
+	}
+	else {
+		// gimbal lock : only a - c (or a + c) is known, keep the first angle
+		// of the previous frame and solve the last one
+		a = hint[i];
+		BvhQuat undo = axis_quat(i, -a);
+		double r[3][3];
+		quat_to_matrix(bvh_quat_mul(q, undo), r);
+		c = atan2(-s * r[i][j], r[j][j]);
+	}
+
+	// the other decomposition of the same rotation
+	double a2 = a + BVH_PI;
+	double b2 = BVH_PI - b;
+	double c2 = c + BVH_PI;
+
+	a = nearest_turn(a, hint[i]);
+	b = nearest_turn(b, hint[j]);
+	c = nearest_turn(c, hint[k]);
+	a2 = nearest_turn(a2, hint[i]);
+	b2 = nearest_turn(b2, hint[j]);
+	c2 = nearest_turn(c2, hint[k]);
+
+	double d1 = fabs(a - hint[i]) + fabs(b - hint[j]) + fabs(c - hint[k]);
+	double d2 = fabs(a2 - hint[i]) + fabs(b2 - hint[j]) + fabs(c2 - hint[k]);
+	if (d2 < d1) {
+		a = a2;
+		b = b2;
+		c = c2;
+	}
+	euler[i] = a;
+	euler[j] = b;
+	euler[k] = c;
+}
+
+void BvhRotationFilter::addTrack(const BvhRotationTrack &track)
+{
+	m_tracks.push_back(track);
+	m_prev_euler.push_back(0.0);
+	m_prev_euler.push_back(0.0);
+	m_prev_euler.push_back(0.0);
+	m_keep_first.push_back((track.order == track.target_order) && (track.rest.w == 1.0) &&
+		(track.world_rest.w == 1.0) && track.folded.empty());
+}
+
+void BvhRotationFilter::reset()
+{
+	m_started = false;
+	for (size_t i = 0; i < m_prev_euler.size(); i++) {
+		m_prev_euler[i] = 0.0;
+	}
+}
+
+template <class T>
+void BvhRotationFilter::applyFrames(T *frames, int frame_count, int channel_count)
+{
+	for (int f = 0; f < frame_count; f++) {
+		T *line = frames + (size_t)f * channel_count;
+		for (size_t t = 0; t < m_tracks.size(); t++) {
+			const BvhRotationTrack &track = m_tracks[t];
+			double *prev = &m_prev_euler[3 * t];
+			double euler[3];
+			for (int axis = 0; axis < 3; axis++) {
+				euler[axis] = line[track.column[axis]] * BVH_DEG_TO_RAD;
+			}
+			if (!m_started && m_keep_first[t]) {
+				// the first frame is kept as written in the file
+				prev[0] = euler[0];
+				prev[1] = euler[1];
+				prev[2] = euler[2];
+				continue;
+			}
+			// the bvh rotation is expressed in the world aligned axes of the
+			// bvh joint, it is moved into the axes of the target at rest
+			BvhQuat q = bvh_euler_to_quat(euler, track.order);
+			for (size_t i = track.folded.size(); i > 0; i--) {
+				const BvhFoldedRotation &folded = track.folded[i - 1];
+				q = bvh_quat_mul(axis_quat(folded.axis, line[folded.column] * BVH_DEG_TO_RAD), q);
+			}
+			q = bvh_quat_mul(q, track.world_rest);
+			q = bvh_quat_mul(bvh_quat_conjugate(track.world_rest), q);
+			q = bvh_quat_mul(track.rest, q);
+			bvh_quat_to_euler(q, track.target_order, prev, euler);
+			for (int axis = 0; axis < 3; axis++) {
+				line[track.column[axis]] = (T)(euler[axis] * BVH_RAD_TO_DEG);
+				prev[axis] = euler[axis];
+			}
+		}
+		m_started = true;
+	}
+}
+
+void BvhRotationFilter::apply(double *frames, int frame_count, int channel_count)
+{
+	applyFrames(frames, frame_count, channel_count);
+}
+
+void BvhRotationFilter::apply(float *frames, int frame_count, int channel_count)
+{
+	applyFrames(frames, frame_count, channel_count);
+}
+
+template <class T>
+void BvhPositionFilter::applyFrames(T *frames, int frame_count, int channel_count)
+{
+	for (size_t t = 0; t < m_tracks.size(); t++) {
+		const BvhPositionTrack &track = m_tracks[t];
+		double m[3][3];
+		quat_to_matrix(bvh_quat_conjugate(track.parent_rest), m);
+		for (int f = 0; f < frame_count; f++) {
+			T *line = frames + (size_t)f * channel_count;
+			double delta[3];
+			for (int axis = 0; axis < 3; axis++) {
+				delta[axis] = (track.column[axis] == -1) ? 0.0 : line[track.column[axis]] - track.offset[axis];
+			}
+			for (int axis = 0; axis < 3; axis++) {
+				if (track.column[axis] != -1) {
+					line[track.column[axis]] = (T)(track.rest_translation[axis] +
+						m[axis][0] * delta[0] + m[axis][1] * delta[1] + m[axis][2] * delta[2]);
+				}
+			}
+		}
+	}
+}
+
+void BvhPositionFilter::apply(double *frames, int frame_count, int channel_count)
+{
+	applyFrames(frames, frame_count, channel_count);
+}
+
+void BvhPositionFilter::apply(float *frames, int frame_count, int channel_count)
+{
+	applyFrames(frames, frame_count, channel_count);
+}
+
+int bvh_find_joint(const BvhSkeleton &skeleton, const std::string &name)
+{
+	for (size_t j = 0; j < skeleton.joints.size(); j++) {
+		if (!skeleton.joints[j].end_site && (skeleton.joints[j].name == name)) {
+			return (int)j;
+		}
+	}
+	return -1;
+}
+
+bool bvh_rotation_track(const BvhSkeleton &skeleton, int joint_index, BvhRotationTrack &track)
+{
+	const BvhJoint &joint = skeleton.joints[joint_index];
+	if (!joint.rotation_track) {
+		return false;
+	}
+	track.order = joint.order;
+	track.target_order = joint.order;
+	for (size_t c = 0; c < joint.channels.size(); c++) {
+		if (bvh_is_rotation(joint.channels[c])) {
+			track.column[joint.channels[c] - kBvhXrotation] = joint.first_channel + (int)c;
+		}
+	}
+	return true;
+}
+
+bool bvh_position_track(const BvhSkeleton &skeleton, int joint_index, BvhPositionTrack &track)
+{
+	const BvhJoint &joint = skeleton.joints[joint_index];
+	bool found = false;
+	for (size_t c = 0; c < joint.channels.size(); c++) {
+		if ((joint.channels[c] != kBvhInvalidChannel) && !bvh_is_rotation(joint.channels[c])) {
+			track.column[joint.channels[c] - kBvhXposition] = joint.first_channel + (int)c;
+			found = true;
+		}
+	}
+	for (int axis = 0; axis < 3; axis++) {
+		track.offset[axis] = joint.offset[axis];
+	}
+	return found;
+}
+
+int bvh_fold_unmapped_parents(const BvhSkeleton &skeleton, int joint, const std::vector<bool> &mapped,
+	BvhRotationTrack &track)
+{
+	int rotated_parents = 0;
+	track.folded.clear();
+	for (int p = skeleton.joints[joint].parent; (p != -1) && !mapped[p]; p = skeleton.joints[p].parent) {
+		const BvhJoint &parent = skeleton.joints[p];
+		std::vector<BvhFoldedRotation> rotations;
+		for (size_t c = 0; c < parent.channels.size(); c++) {
+			if (bvh_is_rotation(parent.channels[c])) {
+				BvhFoldedRotation rotation;
+				rotation.column = parent.first_channel + (int)c;
+				rotation.axis = parent.channels[c] - kBvhXrotation;
+				rotations.push_back(rotation);
+			}
+		}
+		// channels are applied from the last one, like the rotate orders
+		track.folded.insert(track.folded.begin(), rotations.begin(), rotations.end());
+		rotated_parents += rotations.empty() ? 0 : 1;
+	}
+	return rotated_parents;
+}
+
+void bvh_add_rotation_tracks(const BvhSkeleton &skeleton, BvhRotationFilter &filter)
+{
+	for (size_t j = 0; j < skeleton.joints.size(); j++) {
+		BvhRotationTrack track;
+		if (bvh_rotation_track(skeleton, (int)j, track)) {
+			filter.addTrack(track);
+		}
+	}
+}
+
+// splits a line on blanks (spaces, tabs and the \r of windows files)
+static void split_words(const char *line, std::vector<std::string> &words)
+{
+	words.clear();
+	const char *curr = line;
+	while (*curr != '\0') {
+		while ((*curr == ' ') || (*curr == '\t') || (*curr == '\r')) {
+			curr++;
+		}
+		const char *start = curr;
+		while ((*curr != '\0') && (*curr != ' ') && (*curr != '\t') && (*curr != '\r')) {
+			curr++;
+		}
+		if (curr != start) {
+			words.push_back(std::string(start, curr - start));
+		}
+	}
+}
+
+// strtod accepting only a whole, finite number
+static bool parse_number(const std::string &word, double &value)
+{
+	char *end = NULL;
+	value = strtod(word.c_str(), &end);
+	return (end != word.c_str()) && (*end == '\0') && (value == value) && (fabs(value) <= DBL_MAX);
+}
+
+static bool parse_count(const std::string &word, int max, int &value)
+{
+	char *end = NULL;
+	long count = strtol(word.c_str(), &end, 10);
+	if ((end == word.c_str()) || (*end != '\0') || (count < 0) || (count > max)) {
+		return false;
+	}
+	value = (int)count;
+	return true;
+}
+
+// keeps error messages short when they quote the file
+static std::string quote(const std::string &word)
+{
+	if (word.size() > 32) {
+		return "'" + word.substr(0, 32) + "...'";
+	}
+	return "'" + word + "'";
+}
+
+BvhReader::BvhReader(std::istream &in, const BvhLimits &limits) :
+	m_in(in),
+	m_limits(limits),
+	m_buf(limits.max_line_length + 2, '\0'),
+	m_line_number(0),
+	m_frame_count(0)
+{
+}
+
+bool BvhReader::fail(BvhErrorCode code, const std::string &message)
+{
+	if (m_error.code == kBvhOk) {
+		m_error.code = code;
+		m_error.line = m_line_number;
+		m_error.message = message;
+	}
+	return false;
+}
+
+// reads the next line in m_buf, false at the end of the file or on error
+bool BvhReader::nextLine()
+{
+	if (m_error.code != kBvhOk) {
+		return false;
+	}
+	m_in.getline(&m_buf[0], (std::streamsize)m_buf.size());
+	if (m_in.bad()) {
+		return fail(kBvhReadError, "read error");
+	}
+	if (m_in.fail()) {
+		if (m_in.gcount() == 0) {
+			return false; // end of file
+		}
+		// the buffer is full and the delimiter was not found
+		m_line_number++;
+		return fail(kBvhLineTooLong, "line longer than the limit");
+	}
+	m_line_number++;
+	if (strlen(&m_buf[0]) > m_limits.max_line_length) {
+		return fail(kBvhLineTooLong, "line longer than the limit");
+	}
+	return true;
+}
+
+bool BvhReader::readHierarchy(BvhSkeleton &skeleton)
+{
+	skeleton = BvhSkeleton();
+	std::vector<std::string> words;
+
+	if (!nextLine()) {
+		return fail(kBvhNotBvh, "empty file");
+	}
+	split_words(&m_buf[0], words);
+	if (words.empty() || (words[0] != "HIERARCHY")) {
+		return fail(kBvhNotBvh, "first line is not HIERARCHY");
+	}
+
+	std::vector<int> open_joints; // joints whose "{" was read
+	int pending = -1; // joint waiting for its "{"
+
+	while (nextLine()) {
+		split_words(&m_buf[0], words);
+		for (size_t w = 0; w < words.size(); w++) {
+			const std::string &word = words[w];
+
+			if ((word == "ROOT") || (word == "JOINT") || (word == "End")) {
+				if (pending != -1) {
+					return fail(kBvhSyntaxError, "missing { after " + quote(skeleton.joints[pending].name));
+				}
+				if ((word == "ROOT") != open_joints.empty()) {
+					return fail(kBvhSyntaxError, quote(word) + " at the wrong level");
+				}
+				if (w + 1 >= words.size()) {
+					return fail(kBvhSyntaxError, quote(word) + " without a name");
+				}
+				if ((int)skeleton.joints.size() >= m_limits.max_joints) {
+					return fail(kBvhTooManyJoints, "too many joints");
+				}
+				BvhJoint joint;
+				joint.parent = open_joints.empty() ? -1 : open_joints.back();
+				joint.end_site = (word == "End");
+				if (joint.parent != -1) {
+					if (skeleton.joints[joint.parent].end_site) {
+						return fail(kBvhSyntaxError, "End Site with children");
+					}
+				}
+				if (joint.end_site) {
+					joint.name = skeleton.joints[joint.parent].name + "_tip";
+				}
+				else {
+					joint.name = words[w + 1];
+				}
+				w++;
+				pending = (int)skeleton.joints.size();
+				skeleton.joints.push_back(joint);
+			}
+			else if (word == "{") {
+				if (pending == -1) {
+					return fail(kBvhSyntaxError, "unexpected {");
+				}
+				if ((int)open_joints.size() >= m_limits.max_depth) {
+					return fail(kBvhTooDeep, "hierarchy too deep");
+				}
+				open_joints.push_back(pending);
+				pending = -1;
+			}
+			else if (word == "}") {
+				if ((pending != -1) || open_joints.empty()) {
+					return fail(kBvhSyntaxError, "unexpected }");
+				}
+				open_joints.pop_back();
+			}
+			else if (word == "OFFSET") {
+				if ((pending != -1) || open_joints.empty()) {
+					return fail(kBvhSyntaxError, "OFFSET outside of a joint");
+				}
+				BvhJoint &joint = skeleton.joints[open_joints.back()];
+				for (int i = 0; i < 3; i++) {
+					if ((w + 1 >= words.size()) || !parse_number(words[w + 1], joint.offset[i])) {
+						return fail(kBvhSyntaxError, "OFFSET needs 3 numbers");
+					}
+					w++;
+				}
+			}
+			else if (word == "CHANNELS") {
+				if ((pending != -1) || open_joints.empty()) {
+					return fail(kBvhSyntaxError, "CHANNELS outside of a joint");
+				}
+				BvhJoint &joint = skeleton.joints[open_joints.back()];
+				if (joint.end_site || !joint.channels.empty()) {
+					return fail(kBvhSyntaxError, "unexpected CHANNELS");
+				}
+				int count = 0;
+				if ((w + 1 >= words.size()) || !parse_count(words[w + 1], m_limits.max_channels, count)) {
+					return fail(kBvhSyntaxError, "CHANNELS needs a channel count");
+				}
+				w++;
+				if (count > m_limits.max_channels - skeleton.channel_count) {
+					return fail(kBvhTooManyChannels, "too many channels");
+				}
+				if (words.size() - (w + 1) < (size_t)count) {
+					return fail(kBvhSyntaxError, "CHANNELS lists fewer names than its count");
+				}
+				joint.first_channel = skeleton.channel_count;
+				for (int i = 0; i < count; i++) {
+					w++;
+					joint.channels.push_back(bvh_channel_from_name(words[w].c_str()));
+				}
+				joint.rotation_track = bvh_rotate_order_from_channels(joint.channels, joint.order);
+				skeleton.channel_count += count;
+			}
+			else if (word == "MOTION") {
+				if ((pending != -1) || !open_joints.empty()) {
+					return fail(kBvhUnexpectedEnd, "MOTION inside a joint");
+				}
+				if (skeleton.joints.empty()) {
+					return fail(kBvhSyntaxError, "no joint before MOTION");
+				}
+				return readMotionHeader(skeleton);
+			}
+			else {
+				return fail(kBvhSyntaxError, "unknown keyword " + quote(word));
+			}
+		}
+	}
+	return fail(kBvhUnexpectedEnd, "no MOTION section");
+}
+
+bool BvhReader::readMotionHeader(BvhSkeleton &skeleton)
+{
+	std::vector<std::string> words;
+	bool frames_read = false;
+	while (nextLine()) {
+		split_words(&m_buf[0], words);
+		if (words.empty()) {
+			continue;
+		}
+		if (!frames_read) {
+			if ((words[0] != "Frames:") || (words.size() != 2) ||
+				!parse_count(words[1], m_limits.max_frames, skeleton.declared_frames)) {
+				return fail(kBvhSyntaxError, "missing or invalid Frames: line");
+			}
+			frames_read = true;
+			continue;
+		}
+		if ((words[0] != "Frame") || (words.size() < 2) || (words[1] != "Time:")) {
+			return fail(kBvhSyntaxError, "missing Frame Time: line");
+		}
+		// some exporters leave the value empty
+		if ((words.size() > 2) && !parse_number(words[2], skeleton.frame_time)) {
+			return fail(kBvhSyntaxError, "invalid Frame Time: line");
+		}
+		return true;
+	}
+	return fail(kBvhUnexpectedEnd, "missing Frames: or Frame Time: line");
+}
+
+// makes room for one more frame without letting the vector grow past limit
+template <class T>
+static bool grow_frames(std::vector<T> &frames, size_t channel_count, size_t limit)
+{
+	if (frames.size() + channel_count > limit) {
+		return false;
+	}
+	if (frames.size() + channel_count > frames.capacity()) {
+		size_t grown = 2 * frames.capacity() + channel_count;
+		frames.reserve((grown < limit) ? grown : limit);
+	}
+	return true;
+}
+
+/*
+* Appends up to max_frames frame lines to frames, in double or float.
+* Returns the number of frames read, 0 at the end of the file, -1 on error.
+*/
+template <class T>
+int BvhReader::readFrameLines(const BvhSkeleton &skeleton, std::vector<T> &frames, int max_frames)
+{
+	const size_t channel_count = (size_t)skeleton.channel_count;
+	const size_t line_bytes = channel_count * sizeof(T);
+	const size_t limit = m_limits.max_frame_bytes / sizeof(T);
+
+	// the declared count is only a hint : a file declaring millions of
+	// frames gets BVH_FRAME_RESERVE_BYTES, grow_frames doubles from there
+	size_t reserved = (size_t)skeleton.declared_frames;
+	if (reserved > (size_t)max_frames) {
+		reserved = (size_t)max_frames;
+	}
+	if ((line_bytes > 0) && (reserved > BVH_FRAME_RESERVE_BYTES / line_bytes)) {
+		reserved = BVH_FRAME_RESERVE_BYTES / line_bytes;
+	}
+	frames.reserve(frames.size() + reserved * channel_count);
+
+	int frame_count = 0;
+	while ((frame_count < max_frames) && nextLine()) {
+		const char *curr = &m_buf[0];
+		char *next = NULL;
+		size_t nb_values = 0;
+		while (true) {
+			while ((*curr == ' ') || (*curr == '\t') || (*curr == '\r')) {
+				curr++;
+			}
+			if (*curr == '\0') {
+				break;
+			}
+			double value = strtod(curr, &next);
+			if ((next == curr) || (value != value) || (fabs(value) > std::numeric_limits<T>::max()) ||
+				((*next != '\0') && (*next != ' ') && (*next != '\t') && (*next != '\r'))) {
+				frames.resize(frames.size() - nb_values);
+				fail(kBvhBadFrame, "invalid number in frame");
+				return -1;
+			}
+			if (nb_values == channel_count) {
+				frames.resize(frames.size() - nb_values);
+				fail(kBvhBadFrame, "more values than channels");
+				return -1;
+			}
+			if (nb_values == 0) {
+				if (m_frame_count == m_limits.max_frames) {
+					fail(kBvhTooManyFrames, "too many frames");
+					return -1;
+				}
+				if (!grow_frames(frames, channel_count, limit)) {
+					fail(kBvhTooMuchData, "frames go over the memory limit");
+					return -1;
+				}
+			}
+			frames.push_back((T)value);
+			nb_values++;
+			curr = next;
+		}
+		if (nb_values == 0) {
+			continue; // blank line
+		}
+		if (nb_values != channel_count) {
+			frames.resize(frames.size() - nb_values);
+			fail(kBvhBadFrame, "fewer values than channels");
+			return -1;
+		}
+		frame_count++;
+		m_frame_count++;
+	}
+	return (m_error.code == kBvhOk) ? frame_count : -1;
+}
+
+bool BvhReader::readFrames(const BvhSkeleton &skeleton, std::vector<double> &frames)
+{
+	return readFrameLines(skeleton, frames, m_limits.max_frames) >= 0;
+}
+
+int BvhReader::readFrames(const BvhSkeleton &skeleton, std::vector<double> &window, int max_frames)
+{
+	window.clear();
+	return readFrameLines(skeleton, window, max_frames);
+}
+
+int BvhReader::readFrames(const BvhSkeleton &skeleton, std::vector<float> &window, int max_frames)
+{
+	window.clear();
+	return readFrameLines(skeleton, window, max_frames);
+}
+
+int bvh_window_frames(size_t budget_bytes, size_t bytes_per_frame)
+{
+	size_t frames = (bytes_per_frame > 0) ? budget_bytes / bytes_per_frame : 1;
+	if (frames < 1) {
+		frames = 1;
+	}
+	else if (frames > (size_t)INT_MAX) {
+		frames = INT_MAX;
+	}
+	return (int)frames;
+}
+
+size_t bvh_peak_rss()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return (size_t)counters.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss; // bytes
+#else
+	return (size_t)usage.ru_maxrss * 1024; // kilobytes
+#endif
+#endif
+}
+
+bool bvh_read_joint_map(std::istream &in, std::vector<BvhJointMapping> &mapping, BvhError &error)
+{
+	std::string line;
+	std::vector<std::string> words;
+	int line_number = 0;
+	while (std::getline(in, line)) {
+		line_number++;
+		split_words(line.c_str(), words);
+		if (words.empty() || (words[0][0] == '#')) {
+			continue;
+		}
+		BvhJointMapping joint;
+		if ((words.size() != 2) && (words.size() != 5)) {
+			error.code = kBvhSyntaxError;
+			error.line = line_number;
+			error.message = "expected bvh_joint rig_joint [rx ry rz]";
+			return false;
+		}
+		joint.source = words[0];
+		joint.target = words[1];
+		if (words.size() == 5) {
+			joint.has_rest = true;
+			for (int i = 0; i < 3; i++) {
+				if (!parse_number(words[2 + i], joint.rest[i])) {
+					error.code = kBvhSyntaxError;
+					error.line = line_number;
+					error.message = "invalid rest rotation " + quote(words[2 + i]);
+					return false;
+				}
+			}
+		}
+		for (size_t i = 0; i < mapping.size(); i++) {
+			if (mapping[i].source == joint.source) {
+				error.code = kBvhSyntaxError;
+				error.line = line_number;
+				error.message = quote(joint.source) + " is mapped twice";
+				return false;
+			}
+			// keying a rig joint twice would keep only the last bvh joint
+			if (mapping[i].target == joint.target) {
+				error.code = kBvhSyntaxError;
+				error.line = line_number;
+				error.message = quote(joint.target) + " is the target of " + quote(mapping[i].source) +
+					" and " + quote(joint.source);
+				return false;
+			}
+		}
+		mapping.push_back(joint);
+	}
+	if (in.bad()) {
+		error.code = kBvhReadError;
+		error.line = line_number;
+		error.message = "read error";
+		return false;
+	}
+	return true;
+}
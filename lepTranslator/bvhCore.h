@@ -0,0 +1,322 @@
+//
+//  bvhCore : the maya independent part of the bvh translator.
+//
+//  Nothing in here includes maya headers, so that the same code can be
+//  compiled outside of a maya plugin.
+//
+
+#ifndef BVH_CORE_H
+#define BVH_CORE_H
+
+#include <vector>
+#include <string>
+#include <istream>
+
+const double BVH_PI = 3.14159265358979323846;
+const double BVH_DEG_TO_RAD = BVH_PI / 180.0;
+const double BVH_RAD_TO_DEG = 180.0 / BVH_PI;
+
+// channel names found after "CHANNELS n" in the hierarchy
+enum BvhChannel {
+	kBvhXposition,
+	kBvhYposition,
+	kBvhZposition,
+	kBvhXrotation,
+	kBvhYrotation,
+	kBvhZrotation,
+	kBvhInvalidChannel
+};
+
+/*
+* Rotate orders, named and numbered like the maya "rotateOrder" attribute :
+* "xyz" means X is applied first, then Y, then Z.
+* A bvh joint declaring "Zrotation Yrotation Xrotation" is thus kBvhXYZ.
+*/
+enum BvhRotateOrder {
+	kBvhXYZ = 0,
+	kBvhYZX,
+	kBvhZXY,
+	kBvhXZY,
+	kBvhYXZ,
+	kBvhZYX
+};
+
+struct BvhQuat {
+	double w, x, y, z;
+};
+
+// a * b applies b first (column vectors), like the matrices
+BvhQuat bvh_quat_mul(const BvhQuat &a, const BvhQuat &b);
+BvhQuat bvh_quat_conjugate(const BvhQuat &q);
+
+BvhChannel bvh_channel_from_name(const char *name);
+bool bvh_is_rotation(BvhChannel channel);
+
+// returns false (and kBvhXYZ) when the joint does not have its 3 rotations
+bool bvh_rotate_order_from_channels(const std::vector<BvhChannel> &channels, BvhRotateOrder &order);
+
+// euler angles are always stored as (x, y, z), in radians
+BvhQuat bvh_euler_to_quat(const double euler[3], BvhRotateOrder order);
+
+// Decomposes q in the given order, choosing among the equivalent solutions
+// (and their 2*pi multiples) the one closest to hint.
+void bvh_quat_to_euler(const BvhQuat &q, BvhRotateOrder order, const double hint[3], double euler[3]);
+
+// one rotation channel of a bvh joint that is not retargeted
+struct BvhFoldedRotation {
+	int column;
+	int axis; // 0, 1, 2 for X, Y, Z
+};
+
+/*
+* rotation channels of one joint inside a frame line.
+* For retargeting, a bvh joint rests with world aligned axes while the target
+* joint rests with world orientation W (parents, jointOrient and rest rotate).
+* The rotation keyed is rest * W^-1 * bvh * W : the target turns in world
+* space like the bvh joint does, when its parents are retargeted too.
+* The bvh parents that are not retargeted (up to the nearest one that is)
+* are folded in : bvh is then their rotations, from the top, times the
+* rotation of the joint.
+* It is written back in the target rotate order.
+*/
+struct BvhRotationTrack {
+	int column[3]; // column of the X, Y and Z rotations in the frame line
+	BvhRotateOrder order;        // order of the channels in the file
+	BvhRotateOrder target_order; // order of the joint that is keyed
+	BvhQuat rest;                // identity unless retargeting
+	BvhQuat world_rest;          // W, identity unless retargeting
+	std::vector<BvhFoldedRotation> folded; // in the order they are applied
+
+	BvhRotationTrack() : order(kBvhXYZ), target_order(kBvhXYZ)
+	{
+		column[0] = column[1] = column[2] = -1;
+		rest.w = world_rest.w = 1.0;
+		rest.x = rest.y = rest.z = 0.0;
+		world_rest.x = world_rest.y = world_rest.z = 0.0;
+	}
+};
+
+/*
+* Makes the rotation curves continuous.
+* Every frame goes through a quaternion and back to euler angles in the joint
+* rotate order, picking the decomposition nearest to the previous frame, so
+* +-180 wrap-arounds and flipped solutions disappear without an euler filter.
+* The state is kept between calls to apply, frames can be given in chunks.
+*/
+class BvhRotationFilter {
+public:
+	BvhRotationFilter() : m_started(false) {}
+
+	void addTrack(const BvhRotationTrack &track);
+	int trackCount() const { return (int)m_tracks.size(); }
+	void reset();
+
+	// frames holds frame_count lines of channel_count values, rotations are
+	// in degrees and are rewritten in place (still in degrees).
+	void apply(double *frames, int frame_count, int channel_count);
+	void apply(float *frames, int frame_count, int channel_count);
+
+private:
+	template <class T> void applyFrames(T *frames, int frame_count, int channel_count);
+
+	std::vector<BvhRotationTrack> m_tracks;
+	std::vector<double> m_prev_euler; // 3 per track, radians
+	std::vector<bool> m_keep_first;   // first frame can be kept as written
+	bool m_started;
+};
+
+/*
+* position channels of one joint inside a frame line, when retargeting.
+* The bvh position is taken from the OFFSET in the world aligned axes of the
+* bvh parent, while the rig joint moves in the rest axes P of its parent
+* (world orientation at rest). The position keyed is
+*     rest_translation + P^-1 * (bvh - offset)
+*/
+struct BvhPositionTrack {
+	int column[3];              // column of the X, Y and Z positions, -1 if missing
+	double offset[3];           // OFFSET of the bvh joint
+	double rest_translation[3]; // translation of the rig joint at rest
+	BvhQuat parent_rest;        // P
+
+	BvhPositionTrack()
+	{
+		for (int axis = 0; axis < 3; axis++) {
+			column[axis] = -1;
+			offset[axis] = rest_translation[axis] = 0.0;
+		}
+		parent_rest.w = 1.0;
+		parent_rest.x = parent_rest.y = parent_rest.z = 0.0;
+	}
+};
+
+// rewrites the positions in place, frame by frame (no state)
+class BvhPositionFilter {
+public:
+	void addTrack(const BvhPositionTrack &track) { m_tracks.push_back(track); }
+	int trackCount() const { return (int)m_tracks.size(); }
+
+	void apply(double *frames, int frame_count, int channel_count);
+	void apply(float *frames, int frame_count, int channel_count);
+
+private:
+	template <class T> void applyFrames(T *frames, int frame_count, int channel_count);
+
+	std::vector<BvhPositionTrack> m_tracks;
+};
+
+/*
+* Parsing.
+* The reader never trusts the file : every count found in it is checked
+* against BvhLimits before anything is allocated, and a malformed file stops
+* the parse with a BvhError (code, line and message) instead of crashing.
+*/
+
+enum BvhErrorCode {
+	kBvhOk = 0,
+	kBvhNotBvh,          // first line is not HIERARCHY
+	kBvhReadError,
+	kBvhLineTooLong,
+	kBvhSyntaxError,
+	kBvhTooManyJoints,
+	kBvhTooDeep,
+	kBvhTooManyChannels,
+	kBvhBadFrame,        // not a number, or not one value per channel
+	kBvhTooManyFrames,
+	kBvhTooMuchData,     // frames would go over max_frame_bytes
+	kBvhUnexpectedEnd
+};
+
+struct BvhError {
+	BvhErrorCode code;
+	int line; // 1 based, 0 when not tied to a line
+	std::string message;
+
+	BvhError() : code(kBvhOk), line(0) {}
+};
+
+struct BvhLimits {
+	size_t max_line_length;
+	int max_joints;
+	int max_depth;
+	int max_channels;     // whole skeleton
+	int max_frames;
+	size_t max_frame_bytes; // size of the frame matrix
+
+	BvhLimits() :
+		max_line_length(1 << 20),
+		max_joints(1024),
+		max_depth(256),
+		max_channels(6 * 1024),
+		max_frames(10000000),
+		max_frame_bytes((size_t)1 << 30) {}
+};
+
+// Most bytes reserved for the frames from the "Frames:" count. The count is
+// only a hint : past this, the frames grow (doubling) as they are read.
+const size_t BVH_FRAME_RESERVE_BYTES = (size_t)1 << 20;
+
+// a ROOT, JOINT or End Site of the hierarchy
+struct BvhJoint {
+	std::string name;       // End Sites are named after their parent + "_tip"
+	int parent;             // index in BvhSkeleton::joints, -1 for a root
+	double offset[3];
+	bool end_site;
+	int first_channel;      // column of channels[0] in the frame lines
+	std::vector<BvhChannel> channels;
+	BvhRotateOrder order;
+	bool rotation_track;    // the 3 rotations are there, order is meaningful
+
+	BvhJoint() : parent(-1), end_site(false), first_channel(0), order(kBvhXYZ), rotation_track(false)
+	{
+		offset[0] = offset[1] = offset[2] = 0.0;
+	}
+};
+
+struct BvhSkeleton {
+	std::vector<BvhJoint> joints; // parents always come before their children
+	int channel_count;
+	int declared_frames;    // "Frames:" line
+	double frame_time;      // "Frame Time:" line, 0 if missing
+
+	BvhSkeleton() : channel_count(0), declared_frames(0), frame_time(0.0) {}
+};
+
+class BvhReader {
+public:
+	BvhReader(std::istream &in, const BvhLimits &limits = BvhLimits());
+
+	// reads from HIERARCHY to the "Frame Time:" line
+	bool readHierarchy(BvhSkeleton &skeleton);
+
+	// appends every frame line to frames (channel_count values per frame)
+	bool readFrames(const BvhSkeleton &skeleton, std::vector<double> &frames);
+
+	// Bounded memory : replaces the content of window with the next
+	// max_frames frames at most. Returns the number of frames read,
+	// 0 once all the frames are read, -1 on error.
+	int readFrames(const BvhSkeleton &skeleton, std::vector<double> &window, int max_frames);
+	int readFrames(const BvhSkeleton &skeleton, std::vector<float> &window, int max_frames);
+
+	const BvhError &error() const { return m_error; }
+	int lineNumber() const { return m_line_number; }
+
+private:
+	bool nextLine();
+	bool readMotionHeader(BvhSkeleton &skeleton);
+	bool fail(BvhErrorCode code, const std::string &message);
+	template <class T> int readFrameLines(const BvhSkeleton &skeleton, std::vector<T> &frames, int max_frames);
+
+	std::istream &m_in;
+	BvhLimits m_limits;
+	std::vector<char> m_buf;
+	int m_line_number;
+	int m_frame_count; // frames read so far
+	BvhError m_error;
+};
+
+// frames fitting in budget_bytes, at least 1
+int bvh_window_frames(size_t budget_bytes, size_t bytes_per_frame);
+
+// peak resident memory of the process in bytes, 0 if unknown
+size_t bvh_peak_rss();
+
+// index of the joint with this name, -1 if there is none
+int bvh_find_joint(const BvhSkeleton &skeleton, const std::string &name);
+
+// fills the columns and order of a joint, false if it does not have its 3 rotations
+bool bvh_rotation_track(const BvhSkeleton &skeleton, int joint, BvhRotationTrack &track);
+
+// fills the columns and offset of a joint, false if it has no position
+bool bvh_position_track(const BvhSkeleton &skeleton, int joint, BvhPositionTrack &track);
+
+// Fills track.folded with the rotations of the parents of joint up to the
+// nearest one that is mapped (one flag per joint), returns how many of
+// these parents have rotations.
+int bvh_fold_unmapped_parents(const BvhSkeleton &skeleton, int joint, const std::vector<bool> &mapped,
+	BvhRotationTrack &track);
+
+// one track per joint having its 3 rotations
+void bvh_add_rotation_tracks(const BvhSkeleton &skeleton, BvhRotationFilter &filter);
+
+/*
+* Joint map used to retarget a bvh onto an existing rig. One joint per line :
+*     bvh_joint rig_joint [rx ry rz]
+* rx ry rz (degrees, xyz order) replace the rest rotation of the rig joint.
+* Empty lines and lines starting with # are ignored. A bvh joint, or a rig
+* joint, given twice is an error.
+*/
+struct BvhJointMapping {
+	std::string source;
+	std::string target;
+	bool has_rest;
+	double rest[3];
+
+	BvhJointMapping() : has_rest(false)
+	{
+		rest[0] = rest[1] = rest[2] = 0.0;
+	}
+};
+
+bool bvh_read_joint_map(std::istream &in, std::vector<BvhJointMapping> &mapping, BvhError &error);
+
+#endif
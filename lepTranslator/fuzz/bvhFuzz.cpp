@@ -0,0 +1,356 @@
+//
+//  bvhFuzz : fuzz target for the bvh parsing of bvhCore.
+//
+//  libFuzzer :
+//      clang++ -g -O1 -fsanitize=fuzzer,address,undefined -I.. bvhFuzz.cpp ../bvhCore.cpp -o bvhFuzz
+//      ./bvhFuzz -dict=bvh.dict -rss_limit_mb=512 corpus/
+//  AFL (or replaying files by hand) :
+//      afl-clang-fast++ -DBVH_FUZZ_STANDALONE -I.. bvhFuzz.cpp ../bvhCore.cpp -o bvhFuzz
+//      afl-fuzz -i corpus -o findings -- ./bvhFuzz @@
+//
+//  Besides not crashing, every accepted file must give a consistent
+//  skeleton, the rotation filter must keep the rotations unchanged (and
+//  retarget them in world space onto a rig with its own rest orientations),
+//  and reading the frames by float windows must give the frames of a full read.
+//
+
+#include "bvhCore.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+static void check(bool condition, const char *what)
+{
+	if (!condition) {
+		fprintf(stderr, "property violated : %s\n", what);
+		abort();
+	}
+}
+
+static void check_skeleton(const BvhSkeleton &skeleton)
+{
+	int channel_count = 0;
+	for (size_t j = 0; j < skeleton.joints.size(); j++) {
+		const BvhJoint &joint = skeleton.joints[j];
+		check((joint.parent >= -1) && (joint.parent < (int)j), "parents come before their children");
+		check(!joint.end_site || joint.channels.empty(), "End Sites have no channel");
+		check(joint.channels.empty() || (joint.first_channel == channel_count), "channels are contiguous");
+		channel_count += (int)joint.channels.size();
+	}
+	check(channel_count == skeleton.channel_count, "channel count");
+}
+
+// the filter may change the angles, not the rotation they describe
+static void check_filter(const BvhSkeleton &skeleton, const std::vector<double> &frames)
+{
+	BvhRotationFilter filter;
+	bvh_add_rotation_tracks(skeleton, filter);
+	std::vector<double> filtered(frames);
+	const int channel_count = skeleton.channel_count;
+	const int frame_count = (channel_count > 0) ? (int)(frames.size() / channel_count) : 0;
+	if (frame_count == 0) {
+		return;
+	}
+	filter.apply(&filtered[0], frame_count, channel_count);
+
+	for (size_t j = 0; j < skeleton.joints.size(); j++) {
+		const BvhJoint &joint = skeleton.joints[j];
+		if (!joint.rotation_track) {
+			continue;
+		}
+		int column[3];
+		for (size_t c = 0; c < joint.channels.size(); c++) {
+			if (bvh_is_rotation(joint.channels[c])) {
+				column[joint.channels[c] - kBvhXrotation] = joint.first_channel + (int)c;
+			}
+		}
+		for (int f = 0; f < frame_count; f++) {
+			const double *before = &frames[(size_t)f * channel_count];
+			const double *after = &filtered[(size_t)f * channel_count];
+			double e1[3], e2[3];
+			bool small = true;
+			for (int axis = 0; axis < 3; axis++) {
+				e1[axis] = before[column[axis]] * BVH_DEG_TO_RAD;
+				e2[axis] = after[column[axis]] * BVH_DEG_TO_RAD;
+				check(e2[axis] == e2[axis], "filtered angles are numbers");
+				// far from 0 the angles have lost too much precision to compare
+				small = small && (fabs(before[column[axis]]) < 1e5) && (fabs(after[column[axis]]) < 1e5);
+			}
+			if (!small) {
+				continue;
+			}
+			BvhQuat q1 = bvh_euler_to_quat(e1, joint.order);
+			BvhQuat q2 = bvh_euler_to_quat(e2, joint.order);
+			double dot = q1.w * q2.w + q1.x * q2.x + q1.y * q2.y + q1.z * q2.z;
+			check(fabs(fabs(dot) - 1.0) < 1e-6, "filter keeps the rotations");
+		}
+	}
+}
+
+// quaternion of degrees, false when too far from 0 to be compared
+static bool frame_quat(const double *line, const int column[3], BvhRotateOrder order, BvhQuat &q)
+{
+	double euler[3];
+	for (int axis = 0; axis < 3; axis++) {
+		if (!(fabs(line[column[axis]]) < 1e5)) {
+			return false;
+		}
+		euler[axis] = line[column[axis]] * BVH_DEG_TO_RAD;
+	}
+	q = bvh_euler_to_quat(euler, order);
+	return true;
+}
+
+static BvhQuat angles_quat(double x, double y, double z)
+{
+	double euler[3] = { x, y, z };
+	return bvh_euler_to_quat(euler, kBvhXYZ);
+}
+
+// q * v * q^-1
+static void rotate_vector(const BvhQuat &q, const double v[3], double out[3])
+{
+	BvhQuat p = { 0.0, v[0], v[1], v[2] };
+	BvhQuat r = bvh_quat_mul(q, bvh_quat_mul(p, bvh_quat_conjugate(q)));
+	out[0] = r.x;
+	out[1] = r.y;
+	out[2] = r.z;
+}
+
+// the rig joint moves from its rest like the bvh joint from its offset,
+// once its parent rest orientation is applied
+static void check_positions(const BvhPositionTrack &track, const double *before, const double *after)
+{
+	double bvh_delta[3], rig_delta[3], rig_moved[3];
+	for (int a = 0; a < 3; a++) {
+		if ((track.column[a] == -1) || !(fabs(before[track.column[a]]) < 1e5) || !(fabs(track.offset[a]) < 1e5)) {
+			return;
+		}
+		bvh_delta[a] = before[track.column[a]] - track.offset[a];
+		rig_delta[a] = after[track.column[a]] - track.rest_translation[a];
+	}
+	rotate_vector(track.parent_rest, rig_delta, rig_moved);
+	for (int a = 0; a < 3; a++) {
+		check(fabs(rig_moved[a] - bvh_delta[a]) < 1e-6 * (1.0 + fabs(bvh_delta[a]) + fabs(track.offset[a])),
+			"retargeted positions move like the bvh positions");
+	}
+}
+
+// rotation channels of a joint (any number of them), false when too far from 0
+static bool channels_quat(const BvhJoint &joint, const double *line, BvhQuat &q)
+{
+	q.w = 1.0;
+	q.x = q.y = q.z = 0.0;
+	for (size_t c = 0; c < joint.channels.size(); c++) {
+		if (!bvh_is_rotation(joint.channels[c])) {
+			continue;
+		}
+		double angle = line[joint.first_channel + c];
+		if (!(fabs(angle) < 1e5)) {
+			return false;
+		}
+		double euler[3] = { 0.0, 0.0, 0.0 };
+		euler[joint.channels[c] - kBvhXrotation] = angle * BVH_DEG_TO_RAD;
+		q = bvh_quat_mul(q, bvh_euler_to_quat(euler, kBvhXYZ));
+	}
+	return true;
+}
+
+/*
+* Retargets onto a rig copying the bvh hierarchy, with its own jointOrient,
+* rest rotate and rotateAxis on every joint and another rotate order, and a
+* rotated group (no jointOrient) above the roots and some of the joints.
+* Some joints are left out of the map (kept at rest on the rig, their bvh
+* rotations folded into the joints below) : each mapped joint must get the
+* world rotation of the bvh joint, times its world rest, and move along the
+* axes of its bvh parent.
+*/
+static void check_retarget(const BvhSkeleton &skeleton, const std::vector<double> &frames)
+{
+	const int channel_count = skeleton.channel_count;
+	const int frame_count = (channel_count > 0) ? (int)(frames.size() / channel_count) : 0;
+	const size_t joint_count = skeleton.joints.size();
+	if (frame_count == 0) {
+		return;
+	}
+
+	std::vector<BvhQuat> orient(joint_count), rest(joint_count), axis(joint_count), world_rest(joint_count);
+	std::vector<BvhQuat> group(joint_count); // transform between the joint and its parent
+	std::vector<bool> mapped(joint_count);
+	std::vector<BvhRotationTrack> tracks(joint_count);
+	std::vector<BvhPositionTrack> position_tracks(joint_count);
+	std::vector<bool> has_positions(joint_count, false);
+	for (size_t j = 0; j < joint_count; j++) {
+		mapped[j] = skeleton.joints[j].rotation_track && (j % 4 != 2);
+	}
+	BvhRotationFilter filter;
+	BvhPositionFilter position_filter;
+	for (size_t j = 0; j < joint_count; j++) {
+		const BvhJoint &joint = skeleton.joints[j];
+		orient[j] = angles_quat(0.3 * j + 0.1, -0.7 * j + 0.2, 1.1 * j - 0.4);
+		rest[j] = angles_quat(0.5 * j - 0.3, 0.2 * j + 0.9, -0.4 * j);
+		axis[j] = angles_quat(0.1 * j, -0.2, 0.3);
+		group[j] = ((joint.parent == -1) || (j % 3 == 0)) ? angles_quat(1.2, -0.5 * j, 0.7) : angles_quat(0.0, 0.0, 0.0);
+		BvhQuat parent_world = group[j];
+		if (joint.parent != -1) {
+			parent_world = bvh_quat_mul(world_rest[joint.parent], group[j]);
+		}
+		if (mapped[j]) {
+			has_positions[j] = bvh_position_track(skeleton, (int)j, position_tracks[j]);
+			if (has_positions[j]) {
+				for (int a = 0; a < 3; a++) {
+					position_tracks[j].rest_translation[a] = 10.0 * a - 3.0 * j;
+				}
+				position_tracks[j].parent_rest = parent_world;
+				position_filter.addTrack(position_tracks[j]);
+			}
+			bvh_rotation_track(skeleton, (int)j, tracks[j]);
+			bvh_fold_unmapped_parents(skeleton, (int)j, mapped, tracks[j]);
+			tracks[j].target_order = (BvhRotateOrder)((joint.order + j) % 6);
+			tracks[j].rest = rest[j];
+			tracks[j].world_rest = bvh_quat_mul(parent_world, bvh_quat_mul(orient[j], rest[j]));
+			filter.addTrack(tracks[j]);
+		}
+		world_rest[j] = bvh_quat_mul(parent_world, bvh_quat_mul(orient[j], bvh_quat_mul(rest[j], axis[j])));
+	}
+	std::vector<double> filtered(frames);
+	filter.apply(&filtered[0], frame_count, channel_count);
+	position_filter.apply(&filtered[0], frame_count, channel_count);
+
+	std::vector<BvhQuat> bvh_world(joint_count), rig_world(joint_count);
+	std::vector<bool> comparable(joint_count);
+	for (int f = 0; f < frame_count; f++) {
+		const double *before = &frames[(size_t)f * channel_count];
+		const double *after = &filtered[(size_t)f * channel_count];
+		for (size_t j = 0; j < joint_count; j++) {
+			const BvhJoint &joint = skeleton.joints[j];
+			BvhQuat bvh_local;
+			BvhQuat rig_rotate = rest[j];
+			comparable[j] = ((joint.parent == -1) || comparable[joint.parent]) && channels_quat(joint, before, bvh_local);
+			if (mapped[j]) {
+				comparable[j] = comparable[j] && frame_quat(after, tracks[j].column, tracks[j].target_order, rig_rotate);
+			}
+			if (has_positions[j]) {
+				check_positions(position_tracks[j], before, after);
+			}
+			BvhQuat rig_local = bvh_quat_mul(group[j], bvh_quat_mul(orient[j], bvh_quat_mul(rig_rotate, axis[j])));
+			bvh_world[j] = (joint.parent == -1) ? bvh_local : bvh_quat_mul(bvh_world[joint.parent], bvh_local);
+			rig_world[j] = (joint.parent == -1) ? rig_local : bvh_quat_mul(rig_world[joint.parent], rig_local);
+			if (!mapped[j] || !comparable[j]) {
+				continue;
+			}
+			BvhQuat expected = bvh_quat_mul(bvh_world[j], world_rest[j]);
+			const BvhQuat &q = rig_world[j];
+			double dot = q.w * expected.w + q.x * expected.x + q.y * expected.y + q.z * expected.z;
+			check(fabs(fabs(dot) - 1.0) < 1e-6, "retargeted joints turn like the bvh joints");
+		}
+	}
+}
+
+// reading float windows must give the same frames as reading them all
+static void check_windows(const std::string &content, const BvhLimits &limits, const std::vector<double> &frames)
+{
+	std::istringstream in(content);
+	BvhReader reader(in, limits);
+	BvhSkeleton skeleton;
+	check(reader.readHierarchy(skeleton), "hierarchy read twice");
+	const int channel_count = skeleton.channel_count;
+	const int window_frames = 1 + (int)(content.size() % 7);
+	std::vector<float> window;
+	size_t read = 0;
+	int count;
+	while ((count = reader.readFrames(skeleton, window, window_frames)) > 0) {
+		check(count <= window_frames, "windows are bounded");
+		check(window.size() == (size_t)count * channel_count, "whole frames in the window");
+		for (size_t i = 0; i < window.size(); i++) {
+			check(read + i < frames.size(), "no more frames than a full read");
+			check(window[i] == (float)frames[read + i], "same values as a full read");
+		}
+		read += window.size();
+	}
+	if (count < 0) {
+		// only values out of the float range are refused by a float read
+		check(reader.error().code == kBvhBadFrame, "float windows only refuse numbers");
+		bool out_of_range = false;
+		for (size_t i = read; i < frames.size(); i++) {
+			out_of_range = out_of_range || (fabs(frames[i]) > FLT_MAX);
+		}
+		check(out_of_range, "float windows read a valid file");
+		return;
+	}
+	check(read == frames.size(), "as many frames as a full read");
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	std::string content((const char *)data, size);
+	std::istringstream in(content);
+
+	// small limits so that the fuzzer stays within its memory budget
+	BvhLimits limits;
+	limits.max_line_length = 1 << 16;
+	limits.max_joints = 256;
+	limits.max_channels = 6 * 256;
+	limits.max_frames = 100000;
+	limits.max_frame_bytes = 1 << 24;
+
+	BvhReader reader(in, limits);
+	BvhSkeleton skeleton;
+	std::vector<double> frames;
+	if (!reader.readHierarchy(skeleton)) {
+		check(reader.error().code != kBvhOk, "failures have an error code");
+		return 0;
+	}
+	check_skeleton(skeleton);
+	if (!reader.readFrames(skeleton, frames)) {
+		check(reader.error().code != kBvhOk, "failures have an error code");
+		return 0;
+	}
+	check(frames.size() * sizeof(double) <= limits.max_frame_bytes, "frames stay within the limit");
+	// the declared frame count must not be trusted for allocation
+	const size_t grown_bytes = (2 * frames.size() + 3 * (size_t)skeleton.channel_count) * sizeof(double);
+	check(frames.capacity() * sizeof(double) <= ((grown_bytes > BVH_FRAME_RESERVE_BYTES) ? grown_bytes : BVH_FRAME_RESERVE_BYTES),
+		"allocation follows the frames read");
+	check((skeleton.channel_count == 0) || (frames.size() % skeleton.channel_count == 0), "whole frames only");
+	check_filter(skeleton, frames);
+	check_retarget(skeleton, frames);
+	if (skeleton.channel_count > 0) {
+		check_windows(content, limits, frames);
+	}
+	return 0;
+}
+
+#ifdef BVH_FUZZ_STANDALONE
+// runs the target on each file given, or on stdin
+int main(int argc, char **argv)
+{
+	for (int i = (argc > 1) ? 1 : 0; i < argc; i++) {
+		std::string content;
+		if (argc > 1) {
+			std::ifstream file(argv[i], std::ios::in | std::ios::binary);
+			if (!file) {
+				fprintf(stderr, "%s: could not be opened for reading\n", argv[i]);
+				return 1;
+			}
+			std::ostringstream buffer;
+			buffer << file.rdbuf();
+			content = buffer.str();
+		}
+		else {
+			std::ostringstream buffer;
+			buffer << std::cin.rdbuf();
+			content = buffer.str();
+		}
+		LLVMFuzzerTestOneInput((const uint8_t *)content.data(), content.size());
+	}
+	return 0;
+}
+#endif
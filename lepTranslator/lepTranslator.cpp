@@ -44,8 +44,21 @@
 #include <maya/MFnAnimCurve.h> // for keyframes?
 #include <maya/MNamespace.h>
 #include <maya/MTime.h>
+#include <maya/MTimeArray.h>
+#include <maya/MDoubleArray.h>
+#include <maya/MTransformationMatrix.h>
+#include <maya/MQuaternion.h>
+#include <maya/MPlugArray.h>
+#include <maya/MFnMatrixData.h>
+#include <maya/MAnimUtil.h>
+#include <maya/MDagPath.h>
+#include <maya/MTimer.h>
 #include <string.h>
-#include <list>
+#include <stdlib.h>
+#include <limits.h>
+#include <vector>
+
+#include "bvhCore.h"
 
 //This is the backbone for creating a MPxFileTranslator
 class LepTranslator : public MPxFileTranslator {
@@ -118,41 +131,66 @@ void* LepTranslator::creator()
 MString const LepTranslator::magic("HIERARCHY");
 
 
-bool contains_mstring(MStringArray &m_array, std::string str) {
-	for (unsigned int i = 0; i < m_array.length(); i++) {
-		if (m_array[i] == str.c_str()) {
-			return true; // return true at first occurence
-		}
-	}
-	return false;
-}
-
-/* 
+/*
 * Helper function translates bvh notation
 * into maya notation
 */
-MString maya_notation(MString str_) {
-	if (str_ == "Xposition") {
+MString maya_notation(BvhChannel channel) {
+	if (channel == kBvhXposition) {
 		return "translateX";
 	}
-	else if (str_ == "Yposition") {
+	else if (channel == kBvhYposition) {
 		return "translateY";
 	}
-	else if (str_ == "Zposition") {
-		return "translationZ";
+	else if (channel == kBvhZposition) {
+		return "translateZ";
 	}
-	else if (str_ == "Xrotation") {
+	else if (channel == kBvhXrotation) {
 		return "rotateX";
 	}
-	else if (str_ == "Yrotation") {
+	else if (channel == kBvhYrotation) {
 		return "rotateY";
 	}
-	else if (str_ == "Zrotation") {
+	else if (channel == kBvhZrotation) {
 		return "rotateZ";
 	}
 	return "";
 }
 
+MTransformationMatrix::RotationOrder maya_rotation_order(BvhRotateOrder order) {
+	switch (order) {
+	case kBvhYZX:
+		return MTransformationMatrix::kYZX;
+	case kBvhZXY:
+		return MTransformationMatrix::kZXY;
+	case kBvhXZY:
+		return MTransformationMatrix::kXZY;
+	case kBvhYXZ:
+		return MTransformationMatrix::kYXZ;
+	case kBvhZYX:
+		return MTransformationMatrix::kZYX;
+	default:
+		return MTransformationMatrix::kXYZ;
+	}
+}
+
+BvhRotateOrder bvh_rotation_order(MTransformationMatrix::RotationOrder order) {
+	switch (order) {
+	case MTransformationMatrix::kYZX:
+		return kBvhYZX;
+	case MTransformationMatrix::kZXY:
+		return kBvhZXY;
+	case MTransformationMatrix::kXZY:
+		return kBvhXZY;
+	case MTransformationMatrix::kYXZ:
+		return kBvhYXZ;
+	case MTransformationMatrix::kZYX:
+		return kBvhZYX;
+	default:
+		return kBvhXYZ;
+	}
+}
+
 
 
 
@@ -166,105 +204,363 @@ MStatus make_joint(MObject &parent, MObject &new_obj, MString name)
 	return ret;
 }
 
-MStringArray rstripArray(const MStringArray& array)
+// true when the plug, or one of its children, is animated
+bool is_animated(const MObject &node, const char *attribute)
 {
-	MString tmp_string;
-	const char *curr_chaine = NULL;
-	unsigned int curr_length = 0;
-	MStringArray ret(array.length(), MString(""));
-
-	for (unsigned int i = 0; i < array.length(); i++) {
-
-		std::string curr_string(array[i].asChar());
-		std::string final;
-		for (int j = 0; j < curr_string.length(); j++) {
-			if ((curr_string[j] != ' ') && (curr_string[j] != '\n') &&
-			   (curr_string[j] != '\0') && (curr_string[j] != '\t')) {
-				final += curr_string[j];
-			}
+	MFnDependencyNode mfn_node(node);
+	MPlug plug(node, mfn_node.attribute(attribute));
+	if (MAnimUtil::isAnimated(plug)) {
+		return true;
+	}
+	for (unsigned int i = 0; i < plug.numChildren(); i++) {
+		if (MAnimUtil::isAnimated(plug.child(i))) {
+			return true;
 		}
-		ret[i] = MString(final.c_str());
 	}
-	return ret;
+	return false;
 }
 
+// local transformation of a node in the bind pose (dagPose) it is a member of
+bool bind_pose_transformation(const MObject &node, MTransformationMatrix &xform)
+{
+	MFnDependencyNode mfn_node(node);
+	MPlug message(node, mfn_node.attribute("message"));
+	MPlugArray destinations;
+	message.connectedTo(destinations, false, true);
+	for (unsigned int i = 0; i < destinations.length(); i++) {
+		MFnDependencyNode mfn_pose(destinations[i].node());
+		if ((mfn_pose.typeName() != "dagPose") ||
+			(destinations[i].attribute() != mfn_pose.attribute("members")) ||
+			!MPlug(mfn_pose.object(), mfn_pose.attribute("bindPose")).asBool()) {
+			continue;
+		}
+		MPlug xform_plug(mfn_pose.object(), mfn_pose.attribute("xformMatrix"));
+		MFnMatrixData mfn_data(xform_plug.elementByLogicalIndex(destinations[i].logicalIndex()).asMObject());
+		if (mfn_data.isTransformation()) {
+			xform = mfn_data.transformation();
+			return true;
+		}
+	}
+	return false;
+}
 
-MStringArray lst_to_array(std::list<MString> &channel_lst)
+/*
+* Rest pose of a rig transform. It must not come from the animation already
+* on the rig, or importing onto an animated rig would take the pose of the
+* previous clip at the current time as rest (and drift at each import) :
+* the current values are used when the transform is not animated, else its
+* bind pose. Returns false when it is animated without bind pose.
+* jointOrient is not animated, it is always taken from the joint.
+*/
+struct RigRest {
+	MQuaternion orient; // jointOrient, identity for a transform
+	MQuaternion rotate;
+	MQuaternion axis;   // rotateAxis
+	MVector translation;
+};
+
+bool rig_rest(const MObject &node, RigRest &rest, bool with_translation)
 {
-	MStringArray ret((int)channel_lst.size(), MString(""));
-	std::list<MString>::iterator it;
-	int p = 0;
-	for (it = channel_lst.begin(); it != channel_lst.end(); ++it) {
-		ret[p] = *it;
-		p++;
+	rest = RigRest();
+	MFnTransform mfn_node(node);
+	if (node.hasFn(MFn::kJoint)) {
+		MFnIkJoint(node).getOrientation(rest.orient);
+	}
+	if (!is_animated(node, "rotate") && !(with_translation && is_animated(node, "translate"))) {
+		mfn_node.getRotation(rest.rotate, MSpace::kTransform);
+		rest.axis = mfn_node.rotateOrientation(MSpace::kTransform);
+		rest.translation = mfn_node.getTranslation(MSpace::kTransform);
+		return true;
+	}
+	MTransformationMatrix xform;
+	if (bind_pose_transformation(node, xform)) {
+		rest.rotate = xform.rotation();
+		rest.axis = xform.rotationOrientation();
+		rest.translation = xform.getTranslation(MSpace::kTransform);
+		return true;
 	}
+	rest.axis = mfn_node.rotateOrientation(MSpace::kTransform);
+	return false;
+}
+
+BvhQuat bvh_quat(const MQuaternion &q)
+{
+	BvhQuat ret = { q.w, q.x, q.y, q.z };
 	return ret;
 }
 
-MStringArray array_from_string(MString mstring)
+// rest rotation given in the map : degrees, xyz order
+BvhQuat map_rest(const BvhJointMapping &mapping)
 {
-	std::string tmp(mstring.asChar());
-	std::string curr_string("");
-	int curr_index = 0;
-	bool making_word = false;
-	unsigned int tmp_length = tmp.length();
-	MStringArray ret(96, MString(""));
-	for (unsigned int i = 0; i < tmp_length; i++) {
-		if ((tmp[i] != ' ') && making_word) {
-			// continue current word
-			curr_string = curr_string + tmp[i];
-		}
-		else if ((tmp[i] == ' ') && making_word) { // end of a word
-			making_word = false;
-			ret[curr_index] = MString(curr_string.c_str());
-			curr_string = "";
-			curr_index += 1;
+	double rest[3];
+	for (int axis = 0; axis < 3; axis++) {
+		rest[axis] = mapping.rest[axis] * BVH_DEG_TO_RAD;
+	}
+	return bvh_euler_to_quat(rest, kBvhXYZ);
+}
+
+// a rig joint found in the scene for a line of the map
+struct RigTarget {
+	int source; // bvh joint
+	MDagPath path;
+	const BvhJointMapping *mapping;
+};
+
+/*
+* World orientation, at rest, of the parent of a rig joint : the rest of
+* every parent (jointOrient * rotate * rotateAxis each). Parents that are
+* targets with a rest rotation in the map use it. Returns false, with
+* unknown set to the name of the parent, when a rest pose cannot be known.
+*/
+bool rig_parent_rest(MDagPath path, const std::vector<RigTarget> &targets, BvhQuat &world, MString &unknown)
+{
+	world.w = 1.0;
+	world.x = world.y = world.z = 0.0;
+	for (path.pop(); path.length() > 0; path.pop()) {
+		MObject node = path.node();
+		RigRest rest; // groups have no jointOrient
+		bool known = rig_rest(node, rest, false);
+		BvhQuat rotate = bvh_quat(rest.rotate);
+		for (size_t t = 0; t < targets.size(); t++) {
+			if (targets[t].mapping->has_rest && (targets[t].path.node() == node)) {
+				rotate = map_rest(*targets[t].mapping);
+				known = true;
+			}
 		}
-		else if ((tmp[i] != ' ') && (!making_word)) {
-			// beginning of a new word
-			making_word = true;
-			curr_string = curr_string + tmp[i];
+		if (!known) {
+			unknown = path.partialPathName();
+			return false;
 		}
+		BvhQuat local = bvh_quat_mul(bvh_quat(rest.orient), bvh_quat_mul(rotate, bvh_quat(rest.axis)));
+		world = bvh_quat_mul(local, world);
 	}
-	//last word
-	ret[curr_index] = MString(curr_string.c_str());
-	return ret;
+	return true;
 }
-MString replace_tab_by_spaces(MString &str_wtab)
+
+/*
+* Retargeting : instead of creating joints, the channels of the bvh joints
+* listed in the map file are keyed on the joints of the rig already in the
+* scene. The rotations are moved into the rest orientation of the rig joint
+* and converted to its rotate order (see BvhRotationTrack), the positions
+* into the rest orientation of its parent, from the bvh offset to the rest
+* translation of the rig joint (see BvhPositionTrack). Rest poses are taken
+* by rig_rest. The rotations of bvh joints left out of the map are folded
+* into the mapped joints below them.
+* Joints missing from the map (or from the scene) are not keyed.
+*/
+MStatus bind_rig_joints(const MString &map_name, const BvhSkeleton &skeleton,
+	std::vector<MObject> &joint_objects, BvhRotationFilter &rotation_filter,
+	BvhPositionFilter &position_filter)
 {
-	std::string tmp_string(str_wtab.asChar());
-	std::string ret("");
-	//MString ret("");
-	for (int i = 0; i < tmp_string.length(); i++) {
-		if ((tmp_string[i] != '\t') &&
-		((tmp_string[i] == '0') ||
-			(tmp_string[i] == '1') ||
-			(tmp_string[i] == '2') ||
-			(tmp_string[i] == '3') ||
-			(tmp_string[i] == '4') ||
-			(tmp_string[i] == '5') ||
-			(tmp_string[i] == '6') ||
-			(tmp_string[i] == '7') ||
-			(tmp_string[i] == '8') ||
-			(tmp_string[i] == '9') ||
-			(tmp_string[i] == '-') ||
-			(tmp_string[i] == '.'))
-			) {
-			ret = ret + tmp_string[i];
+	ifstream mapfile(map_name.asChar(), ios::in);
+	if (!mapfile) {
+		cerr << map_name << ": could not be opened for reading\n";
+		return MS::kFailure;
+	}
+	std::vector<BvhJointMapping> mapping;
+	BvhError error;
+	if (!bvh_read_joint_map(mapfile, mapping, error)) {
+		cerr << map_name << ":" << error.line << ": " << error.message.c_str() << " ... aborting\n";
+		return MS::kFailure;
+	}
+
+	// every target is found first : the rest rotations of the map also
+	// change the world rest of the joints below them
+	std::vector<RigTarget> targets;
+	for (size_t m = 0; m < mapping.size(); m++) {
+		RigTarget target;
+		target.source = bvh_find_joint(skeleton, mapping[m].source);
+		target.mapping = &mapping[m];
+		if (target.source == -1) {
+			cerr << map_name << ": no joint " << mapping[m].source.c_str() << " in the bvh\n";
+			continue;
 		}
-		else {
-			ret = ret + ' ';
+		MSelectionList target_selection;
+		if ((target_selection.add(MString(mapping[m].target.c_str())) != MStatus::kSuccess) ||
+			(target_selection.getDagPath(0, target.path) != MStatus::kSuccess) ||
+			!target.path.hasFn(MFn::kTransform)) {
+			cerr << map_name << ": no joint " << mapping[m].target.c_str() << " in the scene\n";
+			continue;
 		}
+		// two names of the same node (short name and full path)
+		for (size_t t = 0; t < targets.size(); t++) {
+			if (targets[t].path.node() == target.path.node()) {
+				cerr << map_name << ": " << mapping[m].target.c_str() << " and "
+					<< targets[t].mapping->target.c_str() << " are the same joint ... aborting\n";
+				return MS::kFailure;
+			}
+		}
+		targets.push_back(target);
+	}
+	if (targets.empty()) {
+		cerr << map_name << ": no joint of the map is both in the bvh and in the scene ... aborting\n";
+		return MS::kFailure;
 	}
-	MString res(ret.c_str());
-	return res;
+	std::vector<bool> mapped(skeleton.joints.size(), false);
+	for (size_t t = 0; t < targets.size(); t++) {
+		mapped[targets[t].source] = true;
+	}
+
+	for (size_t t = 0; t < targets.size(); t++) {
+		const RigTarget &target = targets[t];
+		const int j = target.source;
+		MObject node = target.path.node();
+		joint_objects[j] = node;
+
+		BvhRotationTrack track;
+		BvhPositionTrack position_track;
+		const bool has_rotations = bvh_rotation_track(skeleton, j, track);
+		const bool has_positions = bvh_position_track(skeleton, j, position_track);
+		const int rotated_parents = bvh_fold_unmapped_parents(skeleton, j, mapped, track);
+		if ((rotated_parents > 0) && !has_rotations) {
+			cerr << map_name << ": " << skeleton.joints[j].name.c_str()
+				<< " has not its 3 rotations, the rotations of its unmapped bvh parents are lost\n";
+		}
+		if ((rotated_parents > 0) && has_positions) {
+			cerr << map_name << ": the positions of " << skeleton.joints[j].name.c_str()
+				<< " do not follow the rotations of its unmapped bvh parents\n";
+		}
+		if (!has_rotations && !has_positions) {
+			continue;
+		}
+
+		// the map rest rotation is enough for a joint without positions
+		RigRest rest;
+		if (!rig_rest(node, rest, has_positions) && (has_positions || !target.mapping->has_rest)) {
+			cerr << map_name << ": " << target.mapping->target.c_str()
+				<< " is animated and has no bind pose, its rest pose is unknown ... aborting\n";
+			return MS::kFailure;
+		}
+		BvhQuat parent_rest;
+		MString unknown;
+		if (!rig_parent_rest(target.path, targets, parent_rest, unknown)) {
+			cerr << map_name << ": " << unknown << ", parent of " << target.mapping->target.c_str()
+				<< ", is animated and has no bind pose, its rest pose is unknown ... aborting\n";
+			return MS::kFailure;
+		}
+
+		if (has_positions) {
+			position_track.rest_translation[0] = rest.translation.x;
+			position_track.rest_translation[1] = rest.translation.y;
+			position_track.rest_translation[2] = rest.translation.z;
+			position_track.parent_rest = parent_rest;
+			position_filter.addTrack(position_track);
+		}
+		if (has_rotations) {
+			MFnTransform mfn_target(node);
+			track.target_order = bvh_rotation_order(mfn_target.rotationOrder());
+			track.rest = target.mapping->has_rest ? map_rest(*target.mapping) : bvh_quat(rest.rotate);
+			track.world_rest = bvh_quat_mul(parent_rest, bvh_quat_mul(bvh_quat(rest.orient), track.rest));
+			rotation_filter.addTrack(track);
+		}
+	}
+	return MS::kSuccess;
 }
 
+/*
+* Keys of the curves once grown to hold needed frames. Doubling keeps the
+* number of merges into the curves logarithmic in the length of the take,
+* the declared frame count stops the growth unless the file has more frames.
+*/
+int grown_key_count(int key_count, int needed, int declared_frames)
+{
+	int grown = (key_count > needed - key_count) ? 2 * key_count : needed;
+	if ((declared_frames >= needed) && (grown > declared_frames)) {
+		grown = declared_frames;
+	}
+	return grown;
+}
 
-// An LEP file is an ascii whose first line contains the string <LEP>.
-// The read does not support comments, and assumes that the each
-// subsequent line of the file contains a valid MEL command that can
-// be executed via the "executeCommand" method of the MGlobal class.
+/*
+* Keys the frames on the curves (one per column, null when not keyed).
+* frames already holds the first read_count frames. When window_frames is
+* not 0, frames is a window : once keyed it is refilled with the next
+* frames until the end of the file.
+* The curves are not merged with each window : they are grown ahead by
+* grown_key_count with addKeys (the values of the window, then 0), the keys
+* already there only get their value set. Keys grown past the last frame
+* are removed at the end. When growth_frames is not 0, a growth adds at most
+* growth_frames keys (at least window_frames), which bounds the times and
+* values handed to addKeys.
+* The rotation filter keeps its state from one window to the next.
+*/
+template <class T>
+MStatus key_frames(BvhReader &bvh_reader, const BvhSkeleton &skeleton, std::vector<T> &frames,
+	int read_count, int window_frames, int growth_frames, BvhRotationFilter &rotation_filter,
+	BvhPositionFilter &position_filter, const std::vector<MObject> &curves,
+	const std::vector<double> &channel_scale, int &frame_count)
+{
+	const int channel_count = skeleton.channel_count;
+	MTimeArray times;
+	MDoubleArray values;
+	MFnAnimCurve animcurve;
+	int key_count = 0; // keys on every curve, some may wait for their value
+	frame_count = 0;
+
+	while (read_count > 0) {
+		rotation_filter.apply(&frames[0], read_count, channel_count);
+		position_filter.apply(&frames[0], read_count, channel_count);
+
+		const int needed = frame_count + read_count;
+		int grown = (needed > key_count) ? grown_key_count(key_count, needed, skeleton.declared_frames) : key_count;
+		if ((growth_frames > 0) && (grown - key_count > growth_frames)) {
+			grown = key_count + growth_frames;
+		}
+		const int set_end = (needed < key_count) ? needed : key_count;
+		times.setLength(grown - key_count);
+		values.setLength(grown - key_count);
+		for (int k = key_count; k < grown; k++) {
+			times[k - key_count] = MTime((double)k, MTime::kFilm);
+		}
+		for (int c = 0; c < channel_count; c++) {
+			if (curves[c].isNull()) {
+				continue;
+			}
+			animcurve.setObject(curves[c]);
+			bool keyed = true;
+			for (int k = frame_count; k < set_end; k++) {
+				double value = frames[(size_t)(k - frame_count) * channel_count + c] * channel_scale[c];
+				keyed = (animcurve.setValue(k, value) == MS::kSuccess) && keyed;
+			}
+			if (grown > key_count) {
+				for (int k = key_count; k < grown; k++) {
+					values[k - key_count] = (k < needed) ?
+						frames[(size_t)(k - frame_count) * channel_count + c] * channel_scale[c] : 0.0;
+				}
+				// the first growth replaces the keys a rig curve may have
+				keyed = (animcurve.addKeys(&times, &values, MFnAnimCurve::kTangentGlobal,
+					MFnAnimCurve::kTangentGlobal, key_count > 0) == MS::kSuccess) && keyed;
+			}
+			if (!keyed) {
+				cerr << "ERROR SETTING KEYFRAMES OF " << animcurve.name() << endl;
+			}
+		}
+		key_count = grown;
+		frame_count = needed;
+
+		if (window_frames == 0) {
+			break;
+		}
+		read_count = bvh_reader.readFrames(skeleton, frames, window_frames);
+	}
+
+	// fewer frames than declared, or a bad frame line
+	for (int c = 0; (c < channel_count) && (key_count > frame_count); c++) {
+		if (!curves[c].isNull()) {
+			animcurve.setObject(curves[c]);
+			for (int k = key_count; k > frame_count; k--) {
+				animcurve.remove(k - 1);
+			}
+		}
+	}
+	return (read_count < 0) ? MS::kFailure : MS::kSuccess;
+}
+
+// A BVH file starts with the HIERARCHY of the skeleton, then its MOTION :
+// one line per frame, one value per channel.
+// The file is fully parsed (see bvhCore) before anything is created in
+// the scene, so a malformed file is rejected without leaving half a skeleton
+// (except for the frames after the first window with memoryBudget).
 //
 MStatus LepTranslator::reader ( const MFileObject& file,
                                 const MString& options,
@@ -273,8 +569,6 @@ MStatus LepTranslator::reader ( const MFileObject& file,
     const MString fname = file.fullName();
 
     MStatus rval(MS::kSuccess);
-    const int maxLineSize = 1024;
-    char buf[maxLineSize];
 
     ifstream inputfile(fname.asChar(), ios::in);
     if (!inputfile) {
@@ -283,275 +577,190 @@ MStatus LepTranslator::reader ( const MFileObject& file,
         return MS::kFailure;
     }
 
-    if (!inputfile.getline (buf, maxLineSize)) {
-        cout << "file " << fname << " contained no lines ... aborting\n";
-        return MS::kFailure;
-    }
-
-    if (0 != strncmp(buf, magic.asChar(), magic.length())) {
-        cerr << "first line of file " << fname;
-        cerr << " did not contain " << magic.asChar() << " ... aborting\n";
-        return MS::kFailure;
-    }
+	bool quaternionCurves = false;
+	MString retargetMap; // joint map file, empty when joints are created
+	int memoryBudget = 0; // MB for the frames being read, 0 reads them all at once
+	if (options.length() > 0) {
+		MStringArray optionList;
+		MStringArray theOption;
+		options.split(';', optionList);    // break out all the options.
+
+		for (unsigned int i = 0; i < optionList.length(); ++i) {
+			theOption.clear();
+			optionList[i].split('=', theOption);
+			if (theOption[0] == MString("quaternionCurves") &&
+				theOption.length() > 1) {
+				quaternionCurves = (theOption[1].asInt() > 0);
+			}
+			if (theOption[0] == MString("retargetMap") &&
+				theOption.length() > 1) {
+				retargetMap = theOption[1];
+			}
+			if (theOption[0] == MString("memoryBudget") &&
+				theOption.length() > 1) {
+				memoryBudget = theOption[1].asInt();
+			}
+		}
+	}
 
+	BvhReader bvh_reader(inputfile);
+	BvhSkeleton skeleton;
+	if (!bvh_reader.readHierarchy(skeleton)) {
+		const BvhError &error = bvh_reader.error();
+		cerr << fname << ":" << error.line << ": " << error.message.c_str() << " ... aborting\n";
+		return MS::kFailure;
+	}
+	const int channel_count = skeleton.channel_count;
+
+	// By default every frame is read, and checked, before the scene is touched.
+	// With a memory budget, the frames are read in float windows fitting the
+	// budget and each window is keyed before the next one is read : a bad
+	// frame then stops the import with the previous windows already keyed.
+	std::vector<double> frame_matrix; // one line of channel_count values per frame
+	std::vector<float> frame_window;
+	int window_frames = 0;
+	int growth_frames = 0; // keys added at once to a curve, 0 for as many as needed
+	int read_count;
+	if (memoryBudget > 0) {
+		// half the budget for the window, half for the times and values of the
+		// keys added to the curve being keyed. A window frame is counted with its
+		// time and value too, so growth_frames >= window_frames and a growth
+		// always holds the window.
+		const size_t half_budget = (size_t)memoryBudget << 19;
+		window_frames = bvh_window_frames(half_budget, channel_count * sizeof(float) + sizeof(double) + sizeof(MTime));
+		growth_frames = bvh_window_frames(half_budget, sizeof(double) + sizeof(MTime));
+		read_count = bvh_reader.readFrames(skeleton, frame_window, window_frames);
+	}
+	else {
+		read_count = bvh_reader.readFrames(skeleton, frame_matrix, INT_MAX);
+	}
+	if (read_count < 0) {
+		const BvhError &error = bvh_reader.error();
+		cerr << fname << ":" << error.line << ": " << error.message.c_str() << " ... aborting\n";
+		return MS::kFailure;
+	}
 
 	/*
 	*  make use  of MFnIkJoint MFnAnimCurve OpenMayaAnimlib
 	*/
-	bool close_flag = false;
-	bool motion_frame = false;
-	MObject rootNode = MObject::kNullObj;
-	MObject curr_parent = MObject::kNullObj; //current parent
-	MObject new_parent = MObject::kNullObj;
-
-	std::list<MString> channel_lst; // list of channels in use
-
-	/* main loop */
-	MSelectionList select_lst;
-	MGlobal::getActiveSelectionList(select_lst); // get activeSelectionList
-
 	MStatus ret;
-	MFnIkJoint mfn_joint;
-	MFnIkJoint mfn_debug;
 	MFnIkJoint mfn_util;
-	int time_frame = 0;
-
-	MStringArray channel_array;
-	//mfn_joint.create(MObject::kNullObj, &ret);
-	//mfn_joint.setName(MString("ROOT"));
-	//rootNode = mfn_joint.object();
-	bool change_to_array = true;
-
-
-	//int[] tab_int;
-	//MObject *obj_tab[96];
-	MFnAnimCurve animcurve_tab[96]; // one anim curve per channel
-    while (inputfile.getline (buf, maxLineSize)) {
-        MString cmdString;
-        cmdString.set(buf);
-
-		MStringArray curr_line_array;
-		cmdString.split(' ', curr_line_array);
-		curr_line_array = rstripArray(curr_line_array); // remove whitespaces
-
-		if (!motion_frame) {
-			// debug 
-			if (curr_parent != MObject::kNullObj) {
-				mfn_debug.setObject(curr_parent);
-				cerr << "name of object is" << mfn_debug.name() << endl;
-				cerr << "fullpathname is" << mfn_debug.fullPathName() << endl;
-			}
-			// if startswith root
-			if (curr_line_array[0] == "ROOT") {
-				// supports only one root
-				mfn_joint.create(MObject::kNullObj);
-				mfn_joint.setName(curr_line_array[1]);
-				curr_parent = mfn_joint.object();
-				rootNode = mfn_joint.object();
-				/*
-				// root becomes the hip joint
-				if (rootNode != MObject::kNullObj) {
-					mfn_joint.create(rootNode, &ret);
-					mfn_joint.setName(MString("Hip"));
-					curr_parent = mfn_joint.object();
-				}
-				else {
-					// update the parenthood
-					mfn_joint.create(curr_parent, &ret);
-					mfn_joint.setName(MString(curr_line_array[1]));
-					curr_parent = mfn_joint.object();
-				}*/
-			}
-			else if (contains_mstring(curr_line_array, "MOTION")) {
-				motion_frame = true; // starts reading the keyframes
+
+	std::vector<MObject> joint_objects(skeleton.joints.size(), MObject::kNullObj);
+	BvhRotationFilter rotation_filter;
+	BvhPositionFilter position_filter; // retargeting only
+	if (retargetMap.length() > 0) {
+		ret = bind_rig_joints(retargetMap, skeleton, joint_objects, rotation_filter, position_filter);
+		if (ret != MStatus::kSuccess) {
+			return ret;
+		}
+	}
+	else {
+		// End Sites only give the length of the last bone, no joint is made for them
+		for (size_t j = 0; j < skeleton.joints.size(); j++) {
+			const BvhJoint &joint = skeleton.joints[j];
+			if (joint.end_site) {
+				continue;
 			}
-			else if (contains_mstring(curr_line_array, "JOINT")) {
-				mfn_joint.create(curr_parent, &ret);
-				mfn_joint.setName(curr_line_array[curr_line_array.length() - 1]);
-				curr_parent = mfn_joint.object();
-			} else if (contains_mstring(curr_line_array, "End")) { // if contains "End"
-				close_flag = true;
+			MObject parent = (joint.parent == -1) ? MObject::kNullObj : joint_objects[joint.parent];
+			ret = make_joint(parent, joint_objects[j], MString(joint.name.c_str()));
+			if (ret != MStatus::kSuccess) {
+				cerr << "FAILED TO CREATE JOINT " << joint.name.c_str() << endl;
+				return ret;
 			}
-			else if (contains_mstring(curr_line_array, "}")) {
-				if (close_flag) {
-					close_flag = false;
-						continue;
-				}
-
-				if (curr_parent != MObject::kNullObj) { // if not none
-					// we go one level above
-					MFnIkJoint joint_handle(curr_parent);
-					curr_parent = joint_handle.parent(joint_handle.parentCount() - 1); // this assumes only one parent
-				}
-
-			} else if (contains_mstring(curr_line_array, "CHANNELS")) {
-				// curr_line_array should be curr_line.strip().split(" ")
-				int chan_nb_param = curr_line_array[1].asInt(); // rstrip() needed
-				for (int i = 0; i<chan_nb_param; i++) {
-					mfn_util.setObject(curr_parent);
-					MString tmp = mfn_util.name(); /*fullPathName() + MString(".") + MString(maya_notation(curr_line_array[i + 2]))*/
-					channel_lst.push_back(tmp);
-				}
+			mfn_util.setObject(joint_objects[j]);
+			mfn_util.setTranslation(MVector(joint.offset[0], joint.offset[1], joint.offset[2]), MSpace::kTransform);
+			// the joint rotates in the order its channels are written
+			mfn_util.setRotationOrder(maya_rotation_order(joint.order), false);
+		}
+		bvh_add_rotation_tracks(skeleton, rotation_filter);
+	}
 
-			} else if (contains_mstring(curr_line_array, "OFFSET")) {
+	if (read_count == 0) {
+		if (skeleton.declared_frames != 0) {
+			cerr << fname << ": " << skeleton.declared_frames << " frames declared, 0 read\n";
+		}
+		return rval;
+	}
 
-				// curr_offset should be curr_line.strip().split(" ")
-				mfn_joint.setObject(curr_parent);
-				MString joint_name = mfn_joint.name();
-				if (close_flag) {
-					joint_name = joint_name + MString("_tip");
-				}
-				if ( !curr_parent.isNull()) {
-					mfn_joint.setRotationOrder(MTransformationMatrix::RotationOrder::kXYZ, false); // reorder = false?
-					/*if (!mfn_joint.parent(0).isNull()) {
-						mfn_util.setObject(mfn_joint.parent(0));
-						mfn_joint.setTranslation(mfn_util.getTranslation(MSpace::kTransform), MSpace::kTransform);
-					}*/
-					//if (!mfn_joint.parent(0).isNull()) {
-						//mfn_util.setObject(mfn_joint.parent(0));
-					mfn_joint.setTranslation(MVector(atof(curr_line_array[1].asChar()), atof(curr_line_array[2].asChar()), atof(curr_line_array[3].asChar())), MSpace::kTransform);
-					//}
-				}
+	// one curve per channel, with the scale of its values
+	std::vector<MObject> curves(channel_count, MObject::kNullObj);
+	std::vector<double> channel_scale(channel_count, 1.0);
+	MString rotation_curves;
+	MFnTransform mfn_node;
+	for (size_t j = 0; j < skeleton.joints.size(); j++) {
+		const BvhJoint &joint = skeleton.joints[j];
+		for (size_t i = 0; i < joint.channels.size(); i++) {
+			const BvhChannel channel = joint.channels[i];
+			const int c = joint.first_channel + (int)i;
+			if ((channel == kBvhInvalidChannel) || joint_objects[j].isNull()) {
+				continue;
 			}
-		}
-		else { 
-			
-			if (change_to_array) {
-				channel_array = lst_to_array(channel_lst);
-				change_to_array = false;
+			mfn_node.setObject(joint_objects[j]);
+			MObject curr_attribute = mfn_node.attribute(maya_notation(channel), &ret);
+			if (ret != MStatus::kSuccess) {
+				cerr << "FAILED TO RETRIEVE ATTRIBUTE " << maya_notation(channel) << " OF " << mfn_node.name() << endl;
+				continue;
 			}
 
-			// skip first two lines of motion section
-			if (contains_mstring(curr_line_array, "Frames:")) {
-				continue;
+			// a rig may already be animated, its curves are then rekeyed
+			MPlug curr_plug(joint_objects[j], curr_attribute);
+			MFnAnimCurve animcurve(curr_plug, &ret);
+			if (ret != MStatus::kSuccess) {
+				animcurve.create(joint_objects[j], curr_attribute, NULL, &ret);
 			}
-			if (contains_mstring(curr_line_array, "Frame")) {
+			if (ret != MStatus::kSuccess) {
+				cerr << "FAILED TO CREATE ANIMCURVE FOR " << mfn_node.name() << "." << maya_notation(channel) << endl;
 				continue;
 			}
- 			
-			cerr << "line : " << cmdString << endl;
-			cerr << "channel " << channel_array << endl;
-			MString cmd_string_wo_tab = replace_tab_by_spaces(cmdString);
-			curr_line_array = array_from_string(cmd_string_wo_tab);
-			cerr << "curr_line_array is " << curr_line_array << endl;
-			curr_line_array = rstripArray(curr_line_array); // remove whitespaces
-			MTime maya_time((double) (time_frame), MTime::kFilm);
-
-			MSelectionList curr_selection; // used to store object we select using their names
-			MObject curr_attribute; // store attribute for the current object considered (ie translationX)
-			MObject curr_attribute_rotate;
-			for (unsigned int i = 0; i < curr_line_array.length(); i++) { // for each frame at time_frame $time_frame
-				MSelectionList curr_selection;
-				//cerr << "selecting by name object " << channel_array[i] << endl;
-				MGlobal::getSelectionListByName(channel_array[i], curr_selection); // find by name (not fullPathName?
-				MItSelectionList iter(curr_selection, MFn::kJoint, &ret);
-				MFnIkJoint mfn_test;
-				MObject curr_obj;
-				int itercount = 0;
-				//cerr << "curr value of i is : " << i << endl;
-				//cerr << "curr_line_array length" << curr_line_array.length() << endl;
-				for (; !iter.isDone(); iter.next())
-				{
-					iter.getDependNode(curr_obj); // get the MObject node (result in curr_obj) that correspond to current iterator value
-					mfn_test.setObject(curr_obj); // bind MFnIkJoint function set on curr_obj, used to retrieve the attribute by their names
-
-					if (i < 3) { // because root node has 6 channels, the 3 first being translations, the first 3 are translations
-						if ((i % 3) == 0) {
-						
-							if (time_frame == 0) {
-
-								curr_attribute = mfn_test.attribute("translateX", &ret);
-								if (ret != MStatus::kSuccess) {
-									cerr << "FAILED TO RETRIEVE ATTRIBUTE TRANSLATEX OF HIP" << endl;
-								}
-
-								// if first time we do the keyframe processing (ie time_frame = 0)
-								// then we have not yet created the animcurves
-								animcurve_tab[i].create(curr_obj, curr_attribute, NULL, &ret);
-								if (ret != MStatus::kSuccess) {
-									cerr << "FAILED TO CREATE ATTRIBUTE TRANSLATEX OF HIP" << endl;
-								}
-							}
-
-							animcurve_tab[i].addKeyframe(maya_time, atof(curr_line_array[i].asChar()));
-						}
-						else if ((i % 3) == 1) {
-
-							if (time_frame == 0) {
-								curr_attribute = mfn_test.attribute("translateY", &ret);
-								animcurve_tab[i].create(curr_obj, curr_attribute, NULL, &ret);
-							}
-
-							animcurve_tab[i].addKeyframe(maya_time, atof(curr_line_array[i].asChar()));
-						}
-						else if ((i % 3) == 2) {
-							
-							if (time_frame == 0) {
-								curr_attribute = mfn_test.attribute("translateZ", &ret);
-								animcurve_tab[i].create(curr_obj, curr_attribute, NULL, &ret);
-							}
-
-							MStatus test_status = animcurve_tab[i].addKeyframe(maya_time, atof(curr_line_array[i].asChar()));
-							if (test_status != MStatus::kSuccess) {
-								cerr << "ERROR SETTING TZ KEYFRAME" << endl;
-							}
-						}
-					}
-					else {
-						if ((i % 3) == 0) {
-
-							if (time_frame == 0) {
-								curr_attribute_rotate = mfn_test.attribute("rotateZ", &ret);
-								if (ret != MStatus::kSuccess) {
-									cerr << "FAILED TO RETRIEVE ATTRIBUTE ROTATEZ" << endl;
-								}
-
-								animcurve_tab[i].create(curr_obj, curr_attribute_rotate, NULL, &ret);
-							}
-
-							MStatus rz_status = animcurve_tab[i].addKeyframe(maya_time, atof(curr_line_array[i].asChar())*(3.1415 / 180));
-							/*cerr << "trying to add keyframe added for RZ " << curr_line_array[i] << endl;
-							cerr << "atof is " << atof(curr_line_array[i].asChar()) << endl;
-							cerr << "time_frame is " << time_frame << endl;*/
-							if (rz_status != MStatus::kSuccess) {
-								cerr << "ERROR SETTING RZ KEYFRAME" << endl;
-
-							}
-						}
-						else if ((i % 3) == 1) {
-
-							if (time_frame == 0) {
-								curr_attribute_rotate = mfn_test.attribute("rotateY", &ret);
-								animcurve_tab[i].create(curr_obj, curr_attribute_rotate, NULL, &ret);
-							}
-
-							animcurve_tab[i].addKeyframe(maya_time, atof(curr_line_array[i].asChar())*(3.1415/180));
-						}
-						else if ((i % 3) == 2) {
-
-							if (time_frame == 0) {
-								curr_attribute_rotate = mfn_test.attribute("rotateX", &ret);
-								animcurve_tab[i].create(curr_obj, curr_attribute_rotate, NULL, &ret);
-							}
-
-							animcurve_tab[i].addKeyframe(maya_time, atof(curr_line_array[i].asChar())*( 3.1415 / 180));
-						}
-					}
-					itercount += 1;
-				}
-				if (itercount > 1) {
-					// for our code to work, we for now suppose each joint
-					// has a different name since we do not use the
-					// fullPathName to retrieve them, but only their
-					// .name() (for example "l_hip"
-					cerr << "==== ERROR TWO OBJECTS HAVE SAME NAME " << endl;
-				}
+			curves[c] = animcurve.object();
+
+			// maya keys angles in radians
+			if (bvh_is_rotation(channel)) {
+				channel_scale[c] = BVH_DEG_TO_RAD;
+				rotation_curves += MString(" ") + animcurve.name();
 			}
-			time_frame += 1; // increase time
-			
 		}
-    }
-    inputfile.close();
+	}
+
+	size_t rss_before = bvh_peak_rss();
+	MTimer timer;
+	timer.beginTimer();
+	int frame_count = 0;
+	if (memoryBudget > 0) {
+		ret = key_frames(bvh_reader, skeleton, frame_window, read_count, window_frames, growth_frames,
+			rotation_filter, position_filter, curves, channel_scale, frame_count);
+	}
+	else {
+		ret = key_frames(bvh_reader, skeleton, frame_matrix, read_count, 0, 0,
+			rotation_filter, position_filter, curves, channel_scale, frame_count);
+	}
+	timer.endTimer();
+	inputfile.close();
+	if (ret != MStatus::kSuccess) {
+		const BvhError &error = bvh_reader.error();
+		cerr << fname << ":" << error.line << ": " << error.message.c_str() << " ... aborting after "
+			<< frame_count << " frames\n";
+		return ret;
+	}
+	if (frame_count != skeleton.declared_frames) {
+		cerr << fname << ": " << skeleton.declared_frames << " frames declared, " << frame_count << " read\n";
+	}
+
+	size_t rss_after = bvh_peak_rss();
+	cerr << fname << ": " << frame_count << " frames keyed in " << timer.elapsedTime() << " s, peak RSS "
+		<< (unsigned int)(rss_after >> 20) << " MB ("
+		<< (unsigned int)((rss_after - rss_before) >> 20) << " MB more while keying";
+	if (memoryBudget > 0) {
+		cerr << ", frames read " << window_frames << " and keys added " << growth_frames
+			<< " at a time for a budget of " << memoryBudget << " MB";
+	}
+	cerr << ")\n";
+
+	if (quaternionCurves && (rotation_curves.length() > 0)) {
+		// the euler curves are already unwrapped, maya only has to resample them
+		MGlobal::executeCommand(MString("rotationInterpolation -c quaternionSlerp") + rotation_curves);
+	}
 
     return rval;
 }
@@ -728,7 +937,7 @@ MStatus initializePlugin( MObject obj )
                                         "lepTranslator.rgb",
                                         LepTranslator::creator,
                                         "lepTranslatorOpts",
-                                        "showPositions=1",
+                                        "showPositions=1;quaternionCurves=0",
                                         true );
     if (!status) 
     {